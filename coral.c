@@ -1,5 +1,5 @@
 /*
- * coral - CAIDA CoralReef port number traffic classifier
+ * coral - CAIDA CoralReef port number and IP subnet traffic classifier
  *
  * Author: Paweł Foremski
  * Copyright (c) 2013 IITiS PAN Gliwice <http://www.iitis.pl/>
@@ -9,37 +9,146 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <libpjf/lib.h>
 #include "flowcalc.h"
 
-struct coral {
-	thash *ports;             /**> thash: (int) port number -> tlist of struct port */
-	struct lfc *lfc;          /**> access to libflowcalc */
-	struct flowcalc *fc;      /**> access to flowcalc */
+/* compiled database cache file: format identification */
+#define CACHE_MAGIC "CRLCACHE"
+#define CACHE_VERSION 3
+
+/* A range of port numbers */
+struct range {
+	uint16_t lo;              /**> first port */
+	uint16_t hi;              /**> last port */
+};
+
+/* An IP subnet */
+struct net {
+	uint8_t addr[16];         /**> network address (IPv4: first 4 bytes) */
+	uint8_t plen;             /**> prefix length */
+	bool ip6;                 /**> IPv6 subnet? */
 };
 
-/* Represents a single port -> protocol definition */
+/* Represents a single port -> protocol definition, as read from the text database */
 struct port {
 	int prio;                 /**> rule priority: lower is better */
+	int seq;                  /**> rule position in the database file */
+	uint16_t idx;             /**> rule index in the compiled database */
 	char *name;               /**> protocol name */
 	char *group;              /**> protocol group */
 	bool tcp;                 /**> match TCP flows? */
 	bool udp;                 /**> match UDP flows? */
-	thash *portset;           /**> remote ports: null OR thash: (int) number->true */
+	struct range *ports;      /**> local ports */
+	int nports;               /**> number of local port ranges */
+	struct range *portset;    /**> remote ports: null OR port ranges */
+	int nportset;             /**> number of remote port ranges */
+
+	/* subnet rules: all of these must match, in the given or (if sym) opposite direction */
+	bool net;                 /**> subnet rule? */
+	bool sym;                 /**> match the opposite direction too? */
+	struct range *sports;     /**> source ports: null (any) OR port ranges */
+	int nsports;              /**> number of source port ranges */
+	struct range *dports;     /**> destination ports: null (any) OR port ranges */
+	int ndports;              /**> number of destination port ranges */
+	struct net *srcnets;      /**> source subnets: null (any) OR list of subnets */
+	int nsrcnets;             /**> number of source subnets */
+	struct net *dstnets;      /**> destination subnets: null (any) OR list of subnets */
+	int ndstnets;             /**> number of destination subnets */
+};
+
+/* A compiled rule: no pointers, so it can be stored in the cache file */
+struct rule {
+	uint32_t name;            /**> protocol name: offset in strings */
+	uint32_t group;           /**> protocol group: offset in strings */
+	uint32_t portset;         /**> remote ports: offset in ranges */
+	uint16_t nportset;        /**> number of port ranges, 0 = any */
+	uint8_t tcp;              /**> match TCP flows? */
+	uint8_t udp;              /**> match UDP flows? */
+
+	/* subnet rules, see struct port */
+	uint32_t sports;          /**> source ports: offset in ranges */
+	uint32_t dports;          /**> destination ports: offset in ranges */
+	uint32_t srcnets;         /**> source subnets: offset in nets */
+	uint32_t dstnets;         /**> destination subnets: offset in nets */
+	uint16_t nsports;         /**> number of source port ranges, 0 = any */
+	uint16_t ndports;         /**> number of destination port ranges, 0 = any */
+	uint16_t nsrcnets;        /**> number of source subnets, 0 = any */
+	uint16_t ndstnets;        /**> number of destination subnets, 0 = any */
+	uint8_t sym;              /**> match the opposite direction too? */
+};
+
+/* Sections of the compiled database */
+enum section {
+	SEC_TAB = 0,              /**> uint32_t [2][65536]: see coral->tab */
+	SEC_RULES,                /**> struct rule []: rules sorted by priority, [0] = no match */
+	SEC_RANGES,               /**> struct range []: remote port ranges */
+	SEC_EXTRA,                /**> uint16_t []: see coral->extra */
+	SEC_STRINGS,              /**> char []: protocol names and groups */
+	SEC_NET4,                 /**> uint32_t []: IPv4 subnet LPM table, see lpm_lookup() */
+	SEC_NET6,                 /**> uint32_t []: IPv6 subnet LPM table */
+	SEC_NETS,                 /**> struct net []: subnets of rules */
+	SEC_CAND,                 /**> uint16_t []: see coral->cand */
+	SEC_MAX
+};
+
+/* Compiled database image, the same in memory and in the cache file */
+struct cache_hdr {
+	char magic[8];            /**> CACHE_MAGIC */
+	uint32_t version;         /**> CACHE_VERSION */
+	uint32_t checksum;        /**> checksum of everything after the header */
+	uint64_t size;            /**> total image size, including the header */
+	uint64_t src_size;        /**> size of the source text database */
+	int64_t src_mtime;        /**> modification time of the source text database [ns] */
+
+	struct {
+		uint32_t off;         /**> offset from the beginning of the image */
+		uint32_t num;         /**> number of elements */
+	} sec[SEC_MAX];
+};
+
+struct coral {
+	tlist *defs;              /**> list of struct port, in file order */
+	struct cache_hdr *db;     /**> compiled database image (heap or mmap()) */
+
+	/** (UDP?, local port) -> index of the first matching rule without remote port
+	 * restrictions | (index in extra << 16) */
+	const uint32_t (*tab)[65536];
+	const struct rule *rules; /**> rules sorted by priority, rules[0] = no match */
+	const struct range *ranges; /**> remote port ranges of rules */
+	const uint16_t *extra;    /**> 0-terminated lists of rules restricted to remote ports */
+	const char *strings;      /**> rule names and groups */
+	const uint32_t *net4;     /**> IPv4 subnet rules: LPM table or NULL */
+	const uint32_t *net6;     /**> IPv6 subnet rules: LPM table or NULL */
+	const struct net *nets;   /**> subnets of rules */
+	const uint16_t *cand;     /**> 0-terminated lists of subnet rules to check, sorted by priority */
+
+	struct lfc *lfc;          /**> access to libflowcalc */
+	struct flowcalc *fc;      /**> access to flowcalc */
 };
 
 /*****************************/
 
-/** Parse a range of ports, e.g. 80,8080,6000-6100 */
-thash *portset_parse(struct coral *coral, char descr[128])
+/** Parse a range of ports, e.g. 80,8080,6000-6100
+ * @param num   number of ranges */
+struct range *portset_parse(struct coral *coral, char descr[128], int *num)
 {
 	mmatic *mm = coral->lfc->mm;
-	thash *set;
+	struct range *set;
 	char *str, *tok, *ptr;
 	int i, p1, p2;
 
-	set = thash_create_intkey(NULL, mm);
+	/* count tokens */
+	for (i = 1, ptr = descr; *ptr; ptr++) {
+		if (*ptr == ',') i++;
+	}
+	set = mmatic_zalloc(mm, i * sizeof *set);
+	*num = 0;
 
 	/* parse token-by-token (separated with commas) */
 	for (str = descr;; str = NULL) {
@@ -49,96 +158,839 @@ thash *portset_parse(struct coral *coral, char descr[128])
 		/* is it a list? */
 		ptr = strchr(tok, '-');
 		if (!ptr) {
-			p1 = atoi(tok);
-			thash_uint_set_true(set, p1);
+			p1 = p2 = atoi(tok);
 		} else {
 			*ptr++ = '\0';
 			p1 = atoi(tok);
 			p2 = atoi(ptr);
-			for (i = p1; i <= p2; i++)
-				thash_uint_set_true(set, i);
 		}
+
+		if (p1 < 0 || p2 > UINT16_MAX || p1 > p2)
+			continue;
+
+		set[*num].lo = p1;
+		set[*num].hi = p2;
+		(*num)++;
 	}
 
 	return set;
 }
 
-/** Append given port definition to the database */
-void ports_append(struct coral *coral, int portnum, struct port *portdef)
+/** Check if given remote port number is allowed by a rule */
+static inline bool portset_has(struct coral *coral, const struct rule *rule, uint16_t num)
+{
+	const struct range *r = coral->ranges + rule->portset;
+	int i;
+
+	for (i = 0; i < rule->nportset; i++) {
+		if (num >= r[i].lo && num <= r[i].hi)
+			return true;
+	}
+
+	return false;
+}
+
+/** Check if given port is in one of the local port ranges of a definition */
+static bool port_has(struct port *port, uint32_t num)
+{
+	int i;
+
+	for (i = 0; i < port->nports; i++) {
+		if (num >= port->ports[i].lo && num <= port->ports[i].hi)
+			return true;
+	}
+
+	return false;
+}
+
+/** Order rules by priority, then by position in the file */
+static int rule_cmp(const void *a, const void *b)
+{
+	const struct port *pa = *((struct port **) a);
+	const struct port *pb = *((struct port **) b);
+
+	if (pa->prio != pb->prio)
+		return pa->prio - pb->prio;
+	else
+		return pa->seq - pb->seq;
+}
+
+/*
+ * Longest prefix match: a multibit trie with a 16-bit root stride and 8-bit strides below it, with
+ * prefixes pushed to the leaves. The table is a single uint32_t array: 65536 root entries followed by
+ * 256-entry chunks. An entry is either an offset in coral->cand: the list of subnet rules having a
+ * subnet that covers the address (0 = empty list), or LPM_CHILD | offset of a chunk. IPv4 lookups
+ * take at most 3 memory accesses.
+ */
+#define LPM_CHILD 0x80000000U
+
+/* LPM table under construction */
+struct lpm {
+	uint32_t *tbl;            /**> table */
+	uint32_t num;             /**> number of entries */
+	uint16_t **cand;          /**> candidate lists, shared by IPv4 and IPv6 tables */
+	uint32_t *ncand;          /**> length of cand */
+	thash *memo;              /**> while adding rule idx: list offset + 1 -> new list offset + 1 */
+	uint16_t idx;             /**> rule being added */
+};
+
+/** Get candidate list with rule t->idx added to list at offset old */
+static uint32_t lpm_cand(struct lpm *t, uint32_t old)
+{
+	uint16_t *l;
+	uint32_t new, i, n;
+
+	new = (uintptr_t) thash_uint_get(t->memo, old + 1);
+	if (new)
+		return new - 1;
+
+	for (n = 0; (*t->cand)[old + n]; n++) {
+		if ((*t->cand)[old + n] == t->idx) {
+			thash_uint_set(t->memo, old + 1, (void *) (uintptr_t) (old + 1));
+			return old;
+		}
+	}
+
+	/* keep the list sorted: better rules first */
+	new = *t->ncand;
+	*t->ncand += n + 2;
+	*t->cand = mmatic_realloc(*t->cand, *t->ncand * sizeof(uint16_t));
+	l = *t->cand + new;
+
+	for (i = 0; i < n && (*t->cand)[old + i] < t->idx; i++)
+		*l++ = (*t->cand)[old + i];
+	*l++ = t->idx;
+	for (; i < n; i++)
+		*l++ = (*t->cand)[old + i];
+	*l = 0;
+
+	thash_uint_set(t->memo, old + 1, (void *) (uintptr_t) (new + 1));
+	return new;
+}
+
+/** Add rule t->idx to table entries, also in child chunks */
+static void lpm_fill(struct lpm *t, uint32_t start, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = start; i < start + count; i++) {
+		if (t->tbl[i] & LPM_CHILD)
+			lpm_fill(t, t->tbl[i] & ~LPM_CHILD, 256);
+		else
+			t->tbl[i] = lpm_cand(t, t->tbl[i]);
+	}
+}
+
+/** Add prefix of rule t->idx to the table */
+static void lpm_add(struct lpm *t, const uint8_t *addr, int plen)
+{
+	uint32_t base = 0, idx, span, chunk;
+	int pos = 0, bits = 16, i;
+
+	idx = (addr[0] << 8) | addr[1];
+
+	while (plen > pos + bits) {
+		/* need a child chunk: create one, inheriting the current list */
+		if (!(t->tbl[base + idx] & LPM_CHILD)) {
+			chunk = t->num;
+			t->num += 256;
+			t->tbl = mmatic_realloc(t->tbl, t->num * sizeof(uint32_t));
+
+			for (i = 0; i < 256; i++)
+				t->tbl[chunk + i] = t->tbl[base + idx];
+			t->tbl[base + idx] = LPM_CHILD | chunk;
+		}
+
+		base = t->tbl[base + idx] & ~LPM_CHILD;
+		pos += bits;
+		bits = 8;
+		idx = addr[pos / 8];
+	}
+
+	span = 1 << (pos + bits - plen);
+	lpm_fill(t, base + (idx & ~(span - 1)), span);
+}
+
+/** Find candidate subnet rules for given address
+ * @param len   address length in bytes
+ * @return      offset in coral->cand */
+static inline uint32_t lpm_lookup(const uint32_t *tbl, const uint8_t *addr, int len)
+{
+	uint32_t v;
+	int i = 2;
+
+	v = tbl[(addr[0] << 8) | addr[1]];
+	while ((v & LPM_CHILD) && i < len)
+		v = tbl[(v & ~LPM_CHILD) + addr[i++]];
+
+	return (v & LPM_CHILD) ? 0 : v;
+}
+
+/** Build LPM table for subnet rules of given address family: each rule is added for all its subnets,
+ * source and destination
+ * @param cand  candidate lists (updated)
+ * @param ncand length of cand (updated)
+ * @param num   table size
+ * @retval NULL no such rules */
+static uint32_t *nets_compile(struct coral *coral, struct port **defs, int ndefs, bool ip6,
+	uint16_t **cand, uint32_t *ncand, uint32_t *num)
 {
 	mmatic *mm = coral->lfc->mm;
-	tlist *list;
-	struct port *port;
+	struct port *p;
+	struct lpm t;
+	struct net *n;
+	int i, j;
+
+	t.num = 65536;
+	t.tbl = NULL;
+	t.cand = cand;
+	t.ncand = ncand;
+
+	for (i = 1; i < ndefs; i++) {
+		p = defs[i];
+		if (!p->net) continue;
+
+		t.idx = i;
+		t.memo = thash_create_intkey(NULL, mm);
+
+		for (j = 0; j < p->nsrcnets + p->ndstnets; j++) {
+			n = (j < p->nsrcnets) ? &p->srcnets[j] : &p->dstnets[j - p->nsrcnets];
+
+			if (n->ip6 != ip6) continue;
+			if (!t.tbl) t.tbl = mmatic_zalloc(mm, t.num * sizeof(uint32_t));
+			lpm_add(&t, n->addr, n->plen);
+		}
+
+		thash_free(t.memo);
+	}
+
+	*num = t.tbl ? t.num : 0;
+	return t.tbl;
+}
+
+/** Simple checksum of the database image: FNV-1a over 32-bit words */
+static uint32_t checksum(const void *buf, size_t len)
+{
+	const uint32_t *w = buf;
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len / 4; i++)
+		h = (h ^ w[i]) * 16777619U;
+
+	return h;
+}
+
+/** Point coral at the sections of a compiled database image */
+static void db_attach(struct coral *coral, struct cache_hdr *db)
+{
+	uint8_t *base = (uint8_t *) db;
+
+	coral->db      = db;
+	coral->tab     = (void *) (base + db->sec[SEC_TAB].off);
+	coral->rules   = (void *) (base + db->sec[SEC_RULES].off);
+	coral->ranges  = (void *) (base + db->sec[SEC_RANGES].off);
+	coral->extra   = (void *) (base + db->sec[SEC_EXTRA].off);
+	coral->strings = (void *) (base + db->sec[SEC_STRINGS].off);
+	coral->net4    = db->sec[SEC_NET4].num ? (void *) (base + db->sec[SEC_NET4].off) : NULL;
+	coral->net6    = db->sec[SEC_NET6].num ? (void *) (base + db->sec[SEC_NET6].off) : NULL;
+	coral->nets    = (void *) (base + db->sec[SEC_NETS].off);
+	coral->cand    = (void *) (base + db->sec[SEC_CAND].off);
+}
 
-	list = thash_uint_get(coral->ports, portnum);
-	if (!list) {
-		list = tlist_create(NULL, mm);
-		thash_uint_set(coral->ports, portnum, list);
+/** Compile port definitions into a flat database image
+ * @param src   source text database stat()
+ * @retval NULL failed */
+struct cache_hdr *ports_compile(struct coral *coral, struct stat *src)
+{
+	mmatic *mm = coral->lfc->mm;
+	struct port *port, **defs, **restricted;
+	struct cache_hdr *db;
+	struct rule *rules;
+	struct range *ranges;
+	struct net *nets;
+	uint32_t (*tab)[65536], *net4, *net6;
+	uint16_t *extra, *cand, *netcand;
+	uint8_t *base;
+	char *strings;
+	int i, j, n, ndefs, nr, nextra, nranges, nnets, nstrings, proto;
+	uint32_t num, best, prev, nnet4, nnet6, nnetcand;
+	size_t elsize[SEC_MAX], size;
+
+	/* sort rules by priority: rule index = rule rank */
+	ndefs = tlist_count(coral->defs) + 1;
+	if (ndefs > UINT16_MAX) {
+		dbg(0, "coral: too many rules (%d)\n", ndefs);
+		return NULL;
 	}
 
-	/* try to respect priorities */
-	tlist_reset(list);
-	while (((port) = tlist_iter(list))) {
-		if (portdef->prio < port->prio) {
-			tlist_insertbefore(list, portdef);
-			return;
+	defs = mmatic_zalloc(mm, ndefs * sizeof(struct port *));
+	i = 1;
+	tlist_iter_loop(coral->defs, port)
+		defs[i++] = port;
+	qsort(defs + 1, ndefs - 1, sizeof(struct port *), rule_cmp);
+
+	/* 1. best rule without remote port restrictions: first one wins */
+	tab = mmatic_zalloc(mm, 2 * sizeof *tab);
+	restricted = mmatic_zalloc(mm, ndefs * sizeof(struct port *));
+	nr = nranges = nnets = nstrings = 0;
+
+	for (i = 1; i < ndefs; i++) {
+		port = defs[i];
+		port->idx = i;
+		nstrings += strlen(port->name) + strlen(port->group) + 2;
+		nranges += port->nportset + port->nsports + port->ndports;
+		nnets += port->nsrcnets + port->ndstnets;
+
+		if (port->net) {
+			continue;
+		} else if (port->portset) {
+			restricted[nr++] = port;
+			continue;
 		}
+
+		for (j = 0; j < port->nports; j++) {
+			for (num = port->ports[j].lo; num <= port->ports[j].hi; num++) {
+				if (port->tcp && !tab[0][num]) tab[0][num] = i;
+				if (port->udp && !tab[1][num]) tab[1][num] = i;
+			}
+		}
+	}
+
+	/* 2. restricted rules that take precedence: store in extra, re-use lists for adjacent ports */
+	extra = mmatic_zalloc(mm, sizeof(uint16_t));
+	nextra = 1;
+	cand = mmatic_zalloc(mm, (nr + 1) * sizeof(uint16_t));
+
+	for (proto = 0; proto < 2; proto++) {
+		prev = 0;
+
+		for (num = 0; num <= UINT16_MAX; num++) {
+			best = tab[proto][num];
+
+			n = 0;
+			for (i = 0; i < nr; i++) {
+				port = restricted[i];
+
+				if (best && port->idx > best) break;
+				if (!(proto ? port->udp : port->tcp)) continue;
+
+				if (port_has(port, num))
+					cand[n++] = port->idx;
+			}
+
+			if (n == 0) {
+				prev = 0;
+				continue;
+			}
+			cand[n++] = 0;
+
+			/* same as for previous port? */
+			if (!prev || memcmp(extra + prev, cand, n * sizeof(uint16_t)) != 0) {
+				if (nextra + n > UINT16_MAX) {
+					dbg(0, "coral: too many remote port restrictions\n");
+					return NULL;
+				}
+
+				prev = nextra;
+				extra = mmatic_realloc(extra, (nextra + n) * sizeof(uint16_t));
+				memcpy(extra + prev, cand, n * sizeof(uint16_t));
+				nextra += n;
+			}
+
+			tab[proto][num] = best | (prev << 16);
+		}
+	}
+
+	/* 3. subnet rules */
+	netcand = mmatic_zalloc(mm, sizeof(uint16_t));
+	nnetcand = 1;
+	net4 = nets_compile(coral, defs, ndefs, false, &netcand, &nnetcand, &nnet4);
+	net6 = nets_compile(coral, defs, ndefs, true, &netcand, &nnetcand, &nnet6);
+
+	/* 4. lay out the image */
+	elsize[SEC_TAB]     = sizeof *tab;
+	elsize[SEC_RULES]   = sizeof(struct rule);
+	elsize[SEC_RANGES]  = sizeof(struct range);
+	elsize[SEC_EXTRA]   = sizeof(uint16_t);
+	elsize[SEC_STRINGS] = 1;
+	elsize[SEC_NET4]    = sizeof(uint32_t);
+	elsize[SEC_NET6]    = sizeof(uint32_t);
+	elsize[SEC_NETS]    = sizeof(struct net);
+	elsize[SEC_CAND]    = sizeof(uint16_t);
+
+	db = mmatic_zalloc(mm, sizeof *db);
+	db->sec[SEC_TAB].num     = 2;
+	db->sec[SEC_RULES].num   = ndefs;
+	db->sec[SEC_RANGES].num  = nranges;
+	db->sec[SEC_EXTRA].num   = nextra;
+	db->sec[SEC_STRINGS].num = nstrings;
+	db->sec[SEC_NET4].num    = nnet4;
+	db->sec[SEC_NET6].num    = nnet6;
+	db->sec[SEC_NETS].num    = nnets;
+	db->sec[SEC_CAND].num    = nnetcand;
+
+	size = sizeof *db;
+	for (i = 0; i < SEC_MAX; i++) {
+		db->sec[i].off = size;
+		size += (db->sec[i].num * elsize[i] + 7) & ~7;
+	}
+
+	db = mmatic_realloc(db, size);
+	base = (uint8_t *) db;
+	memset(base + sizeof *db, 0, size - sizeof *db);
+
+	memcpy(db->magic, CACHE_MAGIC, sizeof db->magic);
+	db->version = CACHE_VERSION;
+	db->size = size;
+	db->src_size = src->st_size;
+	db->src_mtime = src->st_mtim.tv_sec * 1000000000LL + src->st_mtim.tv_nsec;
+
+	/* 5. fill it */
+	memcpy(base + db->sec[SEC_TAB].off, tab, 2 * sizeof *tab);
+	memcpy(base + db->sec[SEC_EXTRA].off, extra, nextra * sizeof(uint16_t));
+	if (net4) memcpy(base + db->sec[SEC_NET4].off, net4, nnet4 * sizeof(uint32_t));
+	if (net6) memcpy(base + db->sec[SEC_NET6].off, net6, nnet6 * sizeof(uint32_t));
+	memcpy(base + db->sec[SEC_CAND].off, netcand, nnetcand * sizeof(uint16_t));
+
+	rules   = (void *) (base + db->sec[SEC_RULES].off);
+	ranges  = (void *) (base + db->sec[SEC_RANGES].off);
+	strings = (void *) (base + db->sec[SEC_STRINGS].off);
+	nets    = (void *) (base + db->sec[SEC_NETS].off);
+	nranges = nnets = nstrings = 0;
+
+	for (i = 1; i < ndefs; i++) {
+		port = defs[i];
+
+		rules[i].name = nstrings;
+		strcpy(strings + nstrings, port->name);
+		nstrings += strlen(port->name) + 1;
+
+		rules[i].group = nstrings;
+		strcpy(strings + nstrings, port->group);
+		nstrings += strlen(port->group) + 1;
+
+		rules[i].tcp = port->tcp;
+		rules[i].udp = port->udp;
+
+		if (port->portset) {
+			rules[i].portset = nranges;
+			rules[i].nportset = port->nportset;
+			memcpy(ranges + nranges, port->portset, port->nportset * sizeof(struct range));
+			nranges += port->nportset;
+		}
+
+		if (!port->net)
+			continue;
+
+		rules[i].sym = port->sym;
+
+		rules[i].sports = nranges;
+		rules[i].nsports = port->nsports;
+		memcpy(ranges + nranges, port->sports, port->nsports * sizeof(struct range));
+		nranges += port->nsports;
+
+		rules[i].dports = nranges;
+		rules[i].ndports = port->ndports;
+		memcpy(ranges + nranges, port->dports, port->ndports * sizeof(struct range));
+		nranges += port->ndports;
+
+		rules[i].srcnets = nnets;
+		rules[i].nsrcnets = port->nsrcnets;
+		memcpy(nets + nnets, port->srcnets, port->nsrcnets * sizeof(struct net));
+		nnets += port->nsrcnets;
+
+		rules[i].dstnets = nnets;
+		rules[i].ndstnets = port->ndstnets;
+		memcpy(nets + nnets, port->dstnets, port->ndstnets * sizeof(struct net));
+		nnets += port->ndstnets;
+	}
+
+	db->checksum = checksum(base + sizeof *db, size - sizeof *db);
+
+	if (net4) mmatic_free(net4);
+	if (net6) mmatic_free(net6);
+	mmatic_free(netcand);
+	mmatic_free(cand);
+	mmatic_free(extra);
+	mmatic_free(restricted);
+	mmatic_free(tab);
+	mmatic_free(defs);
+
+	return db;
+}
+
+/** Check LPM table read from the cache file
+ * @param ncand    length of candidate lists */
+static bool lpm_check(const uint32_t *tbl, uint32_t num, uint32_t ncand)
+{
+	uint32_t i, child;
+
+	if (num == 0) return true;
+	if (num < 65536 || (num - 65536) % 256 != 0) return false;
+
+	for (i = 0; i < num; i++) {
+		if (tbl[i] & LPM_CHILD) {
+			/* chunks must follow their parents: no loops */
+			child = tbl[i] & ~LPM_CHILD;
+			if (child <= i || child < 65536 || (child - 65536) % 256 != 0) return false;
+			if (child + 256 > num) return false;
+		} else if (tbl[i] >= ncand) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** Check a database image read from the cache file
+ * @param size  file size
+ * @param src   source text database stat() */
+static bool cache_check(struct cache_hdr *db, size_t size, struct stat *src)
+{
+	const struct rule *rules;
+	const uint32_t (*tab)[65536];
+	const uint16_t *extra, *cand;
+	const struct net *nets;
+	const char *strings;
+	size_t elsize[SEC_MAX];
+	uint32_t i, nrules, nextra, ncand, nnets;
+
+	if (size < sizeof *db) return false;
+	if (memcmp(db->magic, CACHE_MAGIC, sizeof db->magic) != 0) return false;
+	if (db->version != CACHE_VERSION) return false;
+	if (db->size != size) return false;
+
+	/* source database changed? */
+	if (db->src_size != src->st_size) return false;
+	if (db->src_mtime != src->st_mtim.tv_sec * 1000000000LL + src->st_mtim.tv_nsec) return false;
+
+	if (db->checksum != checksum((uint8_t *) db + sizeof *db, size - sizeof *db)) return false;
+
+	/* section bounds */
+	elsize[SEC_TAB]     = 65536 * sizeof(uint32_t);
+	elsize[SEC_RULES]   = sizeof(struct rule);
+	elsize[SEC_RANGES]  = sizeof(struct range);
+	elsize[SEC_EXTRA]   = sizeof(uint16_t);
+	elsize[SEC_STRINGS] = 1;
+	elsize[SEC_NET4]    = sizeof(uint32_t);
+	elsize[SEC_NET6]    = sizeof(uint32_t);
+	elsize[SEC_NETS]    = sizeof(struct net);
+	elsize[SEC_CAND]    = sizeof(uint16_t);
+
+	if (db->sec[SEC_TAB].num != 2) return false;
+	if (db->sec[SEC_RULES].num == 0 || db->sec[SEC_EXTRA].num == 0) return false;
+	if (db->sec[SEC_CAND].num == 0) return false;
+	if (db->sec[SEC_STRINGS].num == 0) return false;
+
+	for (i = 0; i < SEC_MAX; i++) {
+		if (db->sec[i].off % 8 != 0) return false;
+		if ((uint64_t) db->sec[i].off + (uint64_t) db->sec[i].num * elsize[i] > size) return false;
+	}
+
+	/* references between sections */
+	tab     = (void *) ((uint8_t *) db + db->sec[SEC_TAB].off);
+	rules   = (void *) ((uint8_t *) db + db->sec[SEC_RULES].off);
+	extra   = (void *) ((uint8_t *) db + db->sec[SEC_EXTRA].off);
+	strings = (void *) ((uint8_t *) db + db->sec[SEC_STRINGS].off);
+	cand    = (void *) ((uint8_t *) db + db->sec[SEC_CAND].off);
+	nrules  = db->sec[SEC_RULES].num;
+	nextra  = db->sec[SEC_EXTRA].num;
+	ncand   = db->sec[SEC_CAND].num;
+	nnets   = db->sec[SEC_NETS].num;
+
+	if (strings[db->sec[SEC_STRINGS].num - 1] != 0) return false;
+	if (extra[nextra - 1] != 0) return false;
+
+	for (i = 0; i < nextra; i++) {
+		if (extra[i] >= nrules) return false;
+	}
+
+	nets = (void *) ((uint8_t *) db + db->sec[SEC_NETS].off);
+	for (i = 0; i < nnets; i++) {
+		if (nets[i].plen > (nets[i].ip6 ? 128 : 32)) return false;
+	}
+
+	if (cand[ncand - 1] != 0) return false;
+	for (i = 0; i < ncand; i++) {
+		if (cand[i] >= nrules) return false;
+	}
+
+	for (i = 0; i < 65536; i++) {
+		if ((tab[0][i] & 0xffff) >= nrules || (tab[0][i] >> 16) >= nextra) return false;
+		if ((tab[1][i] & 0xffff) >= nrules || (tab[1][i] >> 16) >= nextra) return false;
+	}
+
+	if (!lpm_check((void *) ((uint8_t *) db + db->sec[SEC_NET4].off), db->sec[SEC_NET4].num, ncand))
+		return false;
+	if (!lpm_check((void *) ((uint8_t *) db + db->sec[SEC_NET6].off), db->sec[SEC_NET6].num, ncand))
+		return false;
+
+	for (i = 1; i < nrules; i++) {
+		if (rules[i].name >= db->sec[SEC_STRINGS].num) return false;
+		if (rules[i].group >= db->sec[SEC_STRINGS].num) return false;
+		if ((uint64_t) rules[i].portset + rules[i].nportset > db->sec[SEC_RANGES].num) return false;
+		if ((uint64_t) rules[i].sports + rules[i].nsports > db->sec[SEC_RANGES].num) return false;
+		if ((uint64_t) rules[i].dports + rules[i].ndports > db->sec[SEC_RANGES].num) return false;
+		if ((uint64_t) rules[i].srcnets + rules[i].nsrcnets > nnets) return false;
+		if ((uint64_t) rules[i].dstnets + rules[i].ndstnets > nnets) return false;
+	}
+
+	return true;
+}
+
+/** Try to use the compiled database cache file
+ * @param src   source text database stat() */
+static bool cache_load(struct coral *coral, const char *path, struct stat *src)
+{
+	struct stat st;
+	struct cache_hdr *db;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof *db) {
+		close(fd);
+		return false;
+	}
+
+	db = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (db == MAP_FAILED)
+		return false;
+
+	if (!cache_check(db, st.st_size, src)) {
+		dbg(1, "coral: ignoring stale or invalid cache file %s\n", path);
+		munmap(db, st.st_size);
+		return false;
+	}
+
+	db_attach(coral, db);
+	return true;
+}
+
+/** Write compiled database to the cache file (best effort) */
+static void cache_save(struct coral *coral, const char *path)
+{
+	char *tmp;
+	FILE *fp;
+	bool ok;
+
+	tmp = mmatic_sprintf(coral->lfc->mm, "%s.%d", path, getpid());
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		dbg(1, "coral: could not write cache file %s: %m\n", tmp);
+		return;
+	}
+
+	ok = (fwrite(coral->db, coral->db->size, 1, fp) == 1);
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok || rename(tmp, path) != 0) {
+		dbg(1, "coral: could not write cache file %s: %m\n", path);
+		unlink(tmp);
 	}
 
-	/* if that failed, add at the end */
-	tlist_push(list, portdef);
+	mmatic_free(tmp);
 }
 
-/** Match protocol to given ports and protocol */
-struct port *port_match(struct coral *coral, uint16_t proto, unsigned long sport, unsigned long dport)
+/** Match protocol to given ports and protocol
+ * @return rule index, 0 if nothing matched */
+static inline uint16_t port_match(struct coral *coral, uint16_t proto, uint16_t sport, uint16_t dport)
 {
-	tlist *list;
-	struct port *port;
+	uint32_t v;
+	const uint16_t *ex;
 
 	/* query the database for destination port number */
-	list = thash_uint_get(coral->ports, dport);
-	if (!list)
-		return NULL;
+	v = coral->tab[proto == IPPROTO_UDP][dport];
 
-	/* go through the list of possible matchings */
-	tlist_reset(list);
-	while (((port) = tlist_iter(list))) {
-		/* check IP protocol */
-		switch (proto) {
-			case IPPROTO_TCP:
-				if (!port->tcp) continue;
-				break;
-			case IPPROTO_UDP:
-				if (!port->udp) continue;
-				break;
+	/* rare case: check rules that require specific source ports first */
+	if (v >> 16) {
+		for (ex = coral->extra + (v >> 16); *ex; ex++) {
+			if (portset_has(coral, &coral->rules[*ex], sport))
+				return *ex;
 		}
+	}
+
+	return v & 0xffff;
+}
+
+
+/** Check if port number is in given port ranges */
+static inline bool ranges_have(struct coral *coral, uint32_t off, uint16_t num, uint16_t port)
+{
+	const struct range *r = coral->ranges + off;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (port >= r[i].lo && port <= r[i].hi)
+			return true;
+	}
+
+	return false;
+}
 
-		/* no port list = it matches */
-		if (!port->portset)
-			return port;
-	
-		/* check port list */
-		if (thash_uint_get(port->portset, sport))
-			return port;
+/** Check if address is in one of given subnets */
+static inline bool nets_have(struct coral *coral, uint32_t off, uint16_t num,
+	const uint8_t *addr, bool ip6)
+{
+	const struct net *n = coral->nets + off;
+	int i, bytes, bits;
+
+	for (i = 0; i < num; i++, n++) {
+		if (n->ip6 != ip6)
+			continue;
+
+		bytes = n->plen / 8;
+		bits = n->plen % 8;
+		if (memcmp(n->addr, addr, bytes) != 0)
+			continue;
+		if (bits && ((n->addr[bytes] ^ addr[bytes]) & (0xff << (8 - bits))))
+			continue;
+
+		return true;
 	}
 
-	/* nothing matched */
-	return NULL;
+	return false;
+}
+
+/** Check if subnet rule matches flow in given direction */
+static inline bool net_ok(struct coral *coral, const struct rule *rule, bool ip6,
+	const uint8_t *saddr, uint16_t sport, const uint8_t *daddr, uint16_t dport)
+{
+	if (rule->nsrcnets && !nets_have(coral, rule->srcnets, rule->nsrcnets, saddr, ip6))
+		return false;
+	if (rule->ndstnets && !nets_have(coral, rule->dstnets, rule->ndstnets, daddr, ip6))
+		return false;
+	if (rule->nsports && !ranges_have(coral, rule->sports, rule->nsports, sport))
+		return false;
+	if (rule->ndports && !ranges_have(coral, rule->dports, rule->ndports, dport))
+		return false;
+
+	return true;
 }
 
+/** Match flow to subnet rules: as in CoralReef, the source and destination subnets and ports must
+ * all match (if the rule is symmetric, also in the opposite direction), and the best priority wins.
+ * The LPM tables give the rules with a subnet covering the source or destination address.
+ * @return rule index, 0 if nothing matched */
+static inline uint16_t net_match(struct coral *coral, struct lfc_flow *lf)
+{
+	const uint32_t *tbl;
+	const uint16_t *a, *b;
+	const uint8_t *src, *dst;
+	const struct rule *rule;
+	uint16_t idx;
+	int len;
+
+	if (lf->is_ip6) {
+		tbl = coral->net6;
+		len = 16;
+	} else {
+		tbl = coral->net4;
+		len = 4;
+	}
+
+	if (!tbl)
+		return 0;
+
+	src = (const uint8_t *) &lf->src.addr;
+	dst = (const uint8_t *) &lf->dst.addr;
+	a = coral->cand + lpm_lookup(tbl, src, len);
+	b = coral->cand + lpm_lookup(tbl, dst, len);
 
-/** Parse port definition and call ports_append to add the data to global database */
+	/* merge both candidate lists, sorted by priority */
+	while (*a || *b) {
+		if (!*b || (*a && *a < *b)) {
+			idx = *a++;
+		} else if (!*a || *b < *a) {
+			idx = *b++;
+		} else {
+			idx = *a++;
+			b++;
+		}
+
+		rule = &coral->rules[idx];
+		if (!(lf->proto == IPPROTO_UDP ? rule->udp : rule->tcp))
+			continue;
+
+		if (net_ok(coral, rule, lf->is_ip6, src, lf->src.port, dst, lf->dst.port))
+			return idx;
+		if (rule->sym && net_ok(coral, rule, lf->is_ip6, dst, lf->dst.port, src, lf->src.port))
+			return idx;
+	}
+
+	return 0;
+}
+
+/** Parse a list of subnets, e.g. 192.0.2.0/24,2001:db8::/32
+ * @param num   number of subnets */
+struct net *netset_parse(struct coral *coral, char descr[128], int *num)
+{
+	mmatic *mm = coral->lfc->mm;
+	struct net *set;
+	char *str, *tok, *ptr;
+	int i, max;
+
+	/* count tokens */
+	for (i = 1, ptr = descr; *ptr; ptr++) {
+		if (*ptr == ',') i++;
+	}
+	set = mmatic_zalloc(mm, i * sizeof *set);
+	*num = 0;
+
+	/* parse token-by-token (separated with commas) */
+	for (str = descr;; str = NULL) {
+		tok = strtok(str, ", ");
+		if (!tok) break;
+
+		ptr = strchr(tok, '/');
+		if (ptr) *ptr++ = '\0';
+
+		set[*num].ip6 = (strchr(tok, ':') != NULL);
+		max = set[*num].ip6 ? 128 : 32;
+
+		if (inet_pton(set[*num].ip6 ? AF_INET6 : AF_INET, tok, set[*num].addr) != 1) {
+			dbg(1, "coral: invalid subnet address: %s\n", tok);
+			continue;
+		}
+
+		i = ptr ? atoi(ptr) : max;
+		if (i < 0 || i > max) {
+			dbg(1, "coral: invalid subnet prefix length: %s/%s\n", tok, ptr);
+			continue;
+		}
+		set[*num].plen = i;
+
+		/* clear host bits */
+		if (i % 8) set[*num].addr[i / 8] &= 0xff << (8 - i % 8);
+		for (i = (i + 7) / 8; i < 16; i++)
+			set[*num].addr[i] = 0;
+
+		(*num)++;
+	}
+
+	return set;
+}
+
+/** Is a subnet list given, other than the default of all subnets? */
+static bool net_given(const char *str)
+{
+	return str[0] && !streq(str, "*") && !streq(str, "0.0.0.0/0") && !streq(str, "::/0");
+}
+
+/** Parse port or subnet definition and add it to the database */
 void port_parse(struct coral *coral,
 	char name[128], char group[128],
 	char sports_str[128], char dports_str[128],
+	char srcnet_str[128], char dstnet_str[128], char sym_str[128],
 	char proto_str[128], char prio_str[128])
 {
 	mmatic *mm = coral->lfc->mm;
 	struct port *p;
 	char *tmp;
-	thash *sports;
-	unsigned long pnum;
-	bool tcp = false, udp = false;
+	bool tcp = false, udp = false, net;
 
 	/* filter by IP protocol */
 	if (streq(proto_str, "6")) tcp = true;
@@ -150,7 +1002,9 @@ void port_parse(struct coral *coral,
 	if (streq(group, "")) group = "?";
 	if (streq(prio_str, "")) prio_str = "50";
 
-	if (streq(sports_str, "*")) {
+	net = (net_given(srcnet_str) || net_given(dstnet_str));
+
+	if (!net && streq(sports_str, "*")) {
 		if (streq(dports_str, "*")) return; /* should not happen */
 		tmp = dports_str;
 		dports_str = sports_str;
@@ -167,63 +1021,89 @@ void port_parse(struct coral *coral,
 	p->tcp = tcp;
 	p->udp = udp;
 	p->prio = atoi(prio_str);
+	p->seq = tlist_count(coral->defs);
 
-	if (streq(dports_str, "*"))
-		p->portset = NULL;
-	else
-		p->portset = portset_parse(coral, dports_str);
+	if (net) {
+		/* subnet rule: subnets and ports are matched together, as in CoralReef */
+		p->net = true;
+		p->sym = streq(sym_str, "1");
 
-	/* add to the list */
-	sports = portset_parse(coral, sports_str);
-	thash_reset(sports);
-	while (thash_uint_iter(sports, &pnum))
-		ports_append(coral, pnum, p);
+		if (net_given(srcnet_str)) {
+			p->srcnets = netset_parse(coral, srcnet_str, &p->nsrcnets);
+			if (p->nsrcnets == 0) return;
+		}
+		if (net_given(dstnet_str)) {
+			p->dstnets = netset_parse(coral, dstnet_str, &p->ndstnets);
+			if (p->ndstnets == 0) return;
+		}
+
+		if (sports_str[0] && !streq(sports_str, "*"))
+			p->sports = portset_parse(coral, sports_str, &p->nsports);
+		if (dports_str[0] && !streq(dports_str, "*"))
+			p->dports = portset_parse(coral, dports_str, &p->ndports);
+	} else {
+		if (streq(dports_str, "*"))
+			p->portset = NULL;
+		else
+			p->portset = portset_parse(coral, dports_str, &p->nportset);
 
-	thash_free(sports);
+		p->ports = portset_parse(coral, sports_str, &p->nports);
+	}
+
+	/* add to the list */
+	tlist_push(coral->defs, p);
 }
 
 /** Print the whole ports database */
 void ports_print(struct coral *coral)
 {
-	unsigned long pnum;
-	tlist *list;
-	struct port *port;
+	uint32_t pnum, v;
+	const uint16_t *ex;
+	const struct rule *rule;
+	int proto;
 
-	thash_reset(coral->ports);
-	while (((list) = thash_uint_iter(coral->ports, &pnum))) {
-		printf("%4lu: ", pnum);
+	for (proto = 0; proto < 2; proto++) {
+		for (pnum = 0; pnum <= UINT16_MAX; pnum++) {
+			v = coral->tab[proto][pnum];
+			if (!v) continue;
 
-		tlist_reset(list);
-		while (((port) = tlist_iter(list)))
-			printf("%s (%d) ", port->name, port->prio);
+			printf("%s %5u: ", proto ? "UDP" : "TCP", pnum);
 
-		printf("\n");
+			if (v >> 16) {
+				for (ex = coral->extra + (v >> 16); *ex; ex++) {
+					rule = &coral->rules[*ex];
+					printf("%s (restricted) ", coral->strings + rule->name);
+				}
+			}
+
+			if (v & 0xffff) {
+				rule = &coral->rules[v & 0xffff];
+				printf("%s", coral->strings + rule->name);
+			}
+
+			printf("\n");
+		}
 	}
 }
 
-/*****************************/
-
-bool init(struct lfc *lfc, void **pdata, struct flowcalc *fc)
+/** Read the CoralReef text database
+ *
+ * Besides the port numbers in sport and dport, a definition may give comma-separated lists of IPv4
+ * or IPv6 subnets in srcnet and dstnet (e.g. "srcnet: 192.0.2.0/24,2001:db8::/32"). Then the subnets
+ * and the ports must all match, also in the opposite direction if sym is 1. Flows matching both a
+ * port and a subnet rule get the rule with better priority. */
+bool db_read(struct coral *coral, const char *dbpath)
 {
-	struct coral *coral;
 	FILE *fp;
 	char buf[1024], *key, *val, *ptr;
-	char dbpath[512];
 	int i;
 
 	char name[128] = {0}, group[128] = {0};
 	char sports[128] = {0}, dports[128] = {0};
+	char srcnet[128] = {0}, dstnet[128] = {0}, sym[128] = {0};
 	char proto[128] = {0}, prio[128] = {0};
 
-	/* read the CoralReef database */
-	coral = mmatic_zalloc(lfc->mm, sizeof *coral);
-	coral->ports = thash_create_intkey(NULL, lfc->mm);
-	coral->lfc = lfc;
-	coral->fc = fc;
-
 	/* open the file */
-	strncpy(dbpath, fc->dir, sizeof dbpath);
-	strncat(dbpath, "/coral/Application_ports_Master.txt", sizeof dbpath);
 	fp = fopen(dbpath, "r");
 	if (!fp) {
 		dbg(0, "could not open CoralReef port database from %s: %m\n", dbpath);
@@ -257,12 +1137,15 @@ bool init(struct lfc *lfc, void **pdata, struct flowcalc *fc)
 		/* 'description:' starts new definition */
 		if (streq(key, "description")) {
 			if (name[0])
-				port_parse(coral, name, group, sports, dports, proto, prio);
+				port_parse(coral, name, group, sports, dports, srcnet, dstnet, sym, proto, prio);
 
 			bzero(name, sizeof name);
 			bzero(group, sizeof group);
 			bzero(sports, sizeof sports);
 			bzero(dports, sizeof dports);
+			bzero(srcnet, sizeof srcnet);
+			bzero(dstnet, sizeof dstnet);
+			bzero(sym, sizeof sym);
 			bzero(proto, sizeof proto);
 			bzero(prio, sizeof prio);
 		}
@@ -277,6 +1160,12 @@ bool init(struct lfc *lfc, void **pdata, struct flowcalc *fc)
 			strncpy(sports, val, sizeof sports);
 		} else if (streq(key, "dport")) {
 			strncpy(dports, val, sizeof dports);
+		} else if (streq(key, "srcnet")) {
+			strncpy(srcnet, val, sizeof srcnet);
+		} else if (streq(key, "dstnet")) {
+			strncpy(dstnet, val, sizeof dstnet);
+		} else if (streq(key, "sym")) {
+			strncpy(sym, val, sizeof sym);
 		} else if (streq(key, "protocol")) {
 			strncpy(proto, val, sizeof proto);
 		} else if (streq(key, "priority")) {
@@ -285,8 +1174,55 @@ bool init(struct lfc *lfc, void **pdata, struct flowcalc *fc)
 	}
 	fclose(fp);
 
+	/* flush the last definition */
+	if (name[0])
+		port_parse(coral, name, group, sports, dports, srcnet, dstnet, sym, proto, prio);
+
+	return true;
+}
+
+/*****************************/
+
+static struct fc_str *attr_group, *attr_name;
+
+bool init(struct lfc *lfc, void **pdata, struct flowcalc *fc)
+{
+	struct coral *coral;
+	struct cache_hdr *db;
+	struct stat st;
+	char dbpath[512], *cachepath;
+
+	coral = mmatic_zalloc(lfc->mm, sizeof *coral);
+	coral->defs = tlist_create(NULL, lfc->mm);
+	coral->lfc = lfc;
+	coral->fc = fc;
+
+	snprintf(dbpath, sizeof dbpath, "%s/coral/Application_ports_Master.txt", fc->dir);
+	if (stat(dbpath, &st) != 0) {
+		dbg(0, "could not open CoralReef port database from %s: %m\n", dbpath);
+		return false;
+	}
+
+	/* use the compiled database if still valid */
+	cachepath = mmatic_sprintf(lfc->mm, "%s.cache", dbpath);
+	if (!cache_load(coral, cachepath, &st)) {
+		/* read the CoralReef database */
+		if (!db_read(coral, dbpath))
+			return false;
+
+		db = ports_compile(coral, &st);
+		if (!db)
+			return false;
+
+		db_attach(coral, db);
+		cache_save(coral, cachepath);
+	}
+
 	//ports_print(coral);
 
+	attr_group = fc_str_attr("crl_group");
+	attr_name = fc_str_attr("crl_name");
+
 	*pdata = coral;
 	return true;
 }
@@ -296,31 +1232,40 @@ void header()
 	printf("%%%% coral 0.1\n");
 	printf("%% crl_group: protocol group\n");
 	printf("%% crl_name: protocol name\n");
-	printf("@attribute crl_group string\n");
-	printf("@attribute crl_name string\n");
+	fc_str_header(attr_group);
+	fc_str_header(attr_name);
 }
 
 void flow(struct lfc *lfc, void *pdata, struct lfc_flow *lf, void *data)
 {
 	struct coral *coral = pdata;
-	unsigned long sport, dport;
-	struct port *port;
+	const struct rule *rule;
+	uint16_t sport, dport, idx, net;
 
 	sport = lf->src.port;
 	dport = lf->dst.port;
 
 	/* 1. try normal direction */
-	port = port_match(coral, lf->proto, sport, dport);
+	idx = port_match(coral, lf->proto, sport, dport);
 
 	/* 2. try opposite direction? */
-	if (!port)
-		port = port_match(coral, lf->proto, dport, sport);
+	if (!idx)
+		idx = port_match(coral, lf->proto, dport, sport);
 
-	/* 3. print the result */
-	if (port)
-		printf(",%s,%s", port->group, port->name);
-	else
-		printf(",?crl_group,?crl_name");
+	/* 3. subnet rules: lower index = better priority */
+	net = net_match(coral, lf);
+	if (net && (!idx || net < idx))
+		idx = net;
+
+	/* 4. print the result */
+	if (idx) {
+		rule = &coral->rules[idx];
+		fc_str(attr_group, coral->strings + rule->group);
+		fc_str(attr_name, coral->strings + rule->name);
+	} else {
+		fc_str(attr_group, NULL);
+		fc_str(attr_name, NULL);
+	}
 }
 
 struct module module = {
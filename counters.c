@@ -54,13 +54,16 @@ void flow(struct lfc *lfc, void *plugin,
 {
 	struct flow *t = data;
 
-	printf(",%"PRIu64",%"PRIu64, t->pkts_up, t->pkts_down);
-	printf(",%"PRIu64",%"PRIu64, t->bytes_up, t->bytes_down);
+	fc_val("%"PRIu64, t->pkts_up);
+	fc_val("%"PRIu64, t->pkts_down);
+	fc_val("%"PRIu64, t->bytes_up);
+	fc_val("%"PRIu64, t->bytes_down);
 }
 
 struct module module = {
 	.size = sizeof(struct flow),
 	.header = header,
 	.pkt  = pkt,
+	.uses = FC_USES_HEADERS,
 	.flow = flow
 };
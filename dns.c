@@ -6,6 +6,10 @@
  * Licensed under GNU GPL v. 3
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -14,189 +18,1065 @@
 #include <libpjf/lib.h>
 #include "flowcalc.h"
 
-/* store DNS for 10h */
+/* store DNS for max. 10h */
 #define DNS_BACKLOG 36000.0
 
-struct client {
-	double ts;                     /**> last update timestamp */
-	thash *servers;                /**> names for servers: (uint32_t dst_ip) -> (char *) DNS name */
+/* minimum time to store DNS, even if the TTL is shorter: clients use connections much longer */
+#define DNS_MINTTL 600.0
+
+/* initial number of binding slots, must be a power of 2 */
+#define DNS_TABSIZE (1 << 16)
+
+/* default memory limit for bindings and DNS names [MB], see the dns_maxmem option */
+#define DNS_MAXMEM 1024
+
+/* time wheel: slot duration [s] and number of slots, must cover DNS_BACKLOG */
+#define DNS_WHEEL_RES 60
+#define DNS_WHEEL_SLOTS 1024
+
+/* max. number of expired bindings to remove per packet */
+#define DNS_GC_BUDGET 8
+
+/* end of list */
+#define NIL UINT32_MAX
+
+/* DNS parser limits: compression pointers per name, answers and CNAMEs per message */
+#define DNS_MAXHOPS 16
+#define DNS_MAXANS 64
+#define DNS_MAXCHAIN 8
+
+/* binding table snapshot file, see the dns_snapshot option */
+#define SNAP_MAGIC "DNSSNAP1"
+#define SNAP_VERSION 1
+
+/* An IP address: IPv4 is stored as IPv4-mapped IPv6 address (::ffff:a.b.c.d) */
+union addr {
+	uint8_t b[16];
+	uint32_t w32[4];
+	uint64_t w64[2];
+};
+
+/* A client -> server DNS binding, stored inline in the binding table */
+struct binding {
+	union addr client;             /**> client address */
+	union addr server;             /**> server address */
+	uint32_t name;                 /**> DNS name: offset in names pool, 0 = empty slot */
+	uint32_t expire;               /**> expiry timestamp [s] */
+
+	uint32_t wprev;                /**> time wheel slot list: previous binding */
+	uint32_t wnext;                /**> time wheel slot list: next binding */
+	uint32_t lprev;                /**> LRU list: previous (more recently used) binding */
+	uint32_t lnext;                /**> LRU list: next (less recently used) binding */
 };
 
 struct dnsdata {
 	mmatic *mm;                    /**> memory manager */
-	thash *clients;                /**> client tracking: (uint32_t src_ip) -> (struct client *) */
-	double gcstamp;                /**> timestamp for next garbage collector run */
+
+	struct binding *tab;           /**> open addressing (linear probing) binding table */
+	uint32_t tabsize;              /**> number of slots, a power of 2 */
+	uint32_t count;                /**> number of bindings */
+	uint32_t maxsize;              /**> memory limit: max tabsize */
+	uint32_t maxcount;             /**> memory limit: max count, then LRU bindings are evicted */
+
+	uint32_t wheel[DNS_WHEEL_SLOTS]; /**> time wheel: bindings by expiry time, NIL = empty slot */
+	uint32_t wheel_ts;             /**> start of the oldest time wheel slot not processed yet [s] */
+	uint32_t lru_head;             /**> LRU list: most recently used binding */
+	uint32_t lru_tail;             /**> LRU list: least recently used binding */
+
+	char *names;                   /**> interned DNS names pool, NUL-separated */
+	uint32_t names_len;            /**> used bytes in names */
+	uint32_t names_size;           /**> allocated bytes in names */
+	uint32_t names_max;            /**> memory limit: max names_size */
+	uint32_t *ntab;                /**> open addressing name index: offsets in names, 0 = empty */
+	uint32_t ntabsize;             /**> number of ntab slots, a power of 2 */
+	uint32_t ncount;               /**> number of interned names */
+
+	union addr client;             /**> first client seen, zero if none yet */
+	bool multi;                    /**> seen more than 1 client? */
+
+	uint32_t now;                  /**> timestamp of last packet [s] */
+	const char *snapshot;          /**> snapshot file path, NULL if disabled */
+};
+
+/* Snapshot file header, followed by snap_rec[count] and names[names_len] */
+struct snap_hdr {
+	char magic[8];                 /**> SNAP_MAGIC */
+	uint32_t version;              /**> SNAP_VERSION */
+	uint32_t checksum;             /**> checksum of everything after the header */
+	uint64_t size;                 /**> total file size, including the header */
+	uint32_t count;                /**> number of bindings */
+	uint32_t names_len;            /**> size of the names pool */
+	uint32_t now;                  /**> timestamp of last packet [s] */
+	uint32_t wheel_ts;             /**> time wheel position */
+	union addr client;             /**> first client seen */
+	uint32_t multi;                /**> seen more than 1 client? */
+	uint32_t pad;
+};
+
+/* A binding in the snapshot file, stored from the least recently used */
+struct snap_rec {
+	union addr client;             /**> client address */
+	union addr server;             /**> server address */
+	uint32_t name;                 /**> DNS name: offset in names */
+	uint32_t expire;               /**> expiry timestamp [s] */
 };
 
 struct flowdata {
 	bool is_dns;                   /**> can it be a DNS flow? */
 	bool dns_found;                /**> DNS reply found? */
 	char name[128];                /**> flow DNS name */
+
+	uint8_t *tcpbuf;               /**> DNS over TCP: partial message, NULL if none */
+	uint32_t tcplen;               /**> DNS over TCP: bytes in tcpbuf */
+	uint32_t tcpneed;              /**> DNS over TCP: message length incl. 2-byte prefix, 0 if unknown */
 };
 
-/**************************** utility functions */
-void free_client(void *ptr)
+/* A resource record in the answer section */
+struct answer {
+	uint16_t owner;                /**> owner name offset */
+	uint16_t type;                 /**> record type */
+	uint32_t ttl;                  /**> TTL [s] */
+	uint16_t rdoff;                /**> rdata offset */
+	uint16_t rdlen;                /**> rdata length */
+};
+
+/* A name in the CNAME chain of the queried name */
+struct alias {
+	uint16_t name;                 /**> name offset */
+	uint32_t ttl;                  /**> min. TTL along the chain [s] */
+};
+
+/**************************** addresses */
+
+static inline void addr_set4(union addr *a, const void *ip4)
+{
+	a->w64[0] = 0;
+	a->w32[2] = htonl(0xffff);
+	memcpy(&a->w32[3], ip4, 4);
+}
+
+static inline void addr_set6(union addr *a, const void *ip6)
+{
+	memcpy(a->b, ip6, 16);
+}
+
+static inline bool addr_is4(const union addr *a)
+{
+	return a->w64[0] == 0 && a->w32[2] == htonl(0xffff);
+}
+
+static inline bool addr_eq(const union addr *a, const union addr *b)
+{
+	return a->w64[0] == b->w64[0] && a->w64[1] == b->w64[1];
+}
+
+/** Print address to given buffer */
+static const char *addr_ntop(const union addr *a, char *buf, int size)
+{
+	if (addr_is4(a))
+		return inet_ntop(AF_INET, &a->w32[3], buf, size);
+	else
+		return inet_ntop(AF_INET6, a->b, buf, size);
+}
+
+/** Set address of flow endpoint */
+static inline void addr_flow(union addr *a, struct lfc_flow *flow, struct lfc_flow_addr *fa)
+{
+	if (flow->is_ip6)
+		addr_set6(a, &fa->addr.ip6);
+	else
+		addr_set4(a, &fa->addr.ip4);
+}
+
+/**************************** binding table */
+
+/** Hash (client, server) pair */
+static inline uint32_t bhash(const union addr *client, const union addr *server)
+{
+	uint64_t k;
+
+	/* IPv4: hash just the 2 addresses */
+	if (addr_is4(client) && addr_is4(server))
+		k = ((uint64_t) client->w32[3] << 32) | server->w32[3];
+	else
+		k = (client->w64[0] * 0x9e3779b97f4a7c15ULL) ^ client->w64[1] ^
+			((server->w64[0] ^ (server->w64[1] << 1)) * 0xc2b2ae3d27d4eb4fULL);
+
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+/** Hash DNS name */
+static inline uint32_t nhash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+
+	return h;
+}
+
+/** Time wheel slot for given expiry time */
+static inline uint32_t *wheel_slot(struct dnsdata *md, uint32_t expire)
+{
+	return &md->wheel[(expire / DNS_WHEEL_RES) % DNS_WHEEL_SLOTS];
+}
+
+/** Link binding in given slot to the time wheel and to the head of the LRU list */
+static void lists_add(struct dnsdata *md, uint32_t i)
+{
+	struct binding *b = &md->tab[i];
+	uint32_t *slot = wheel_slot(md, b->expire);
+
+	b->wprev = NIL;
+	b->wnext = *slot;
+	if (*slot != NIL) md->tab[*slot].wprev = i;
+	*slot = i;
+
+	b->lprev = NIL;
+	b->lnext = md->lru_head;
+	if (md->lru_head != NIL) md->tab[md->lru_head].lprev = i;
+	else                     md->lru_tail = i;
+	md->lru_head = i;
+}
+
+/** Unlink binding in given slot from the time wheel and the LRU list */
+static void lists_del(struct dnsdata *md, uint32_t i)
+{
+	struct binding *b = &md->tab[i];
+
+	if (b->wprev != NIL) md->tab[b->wprev].wnext = b->wnext;
+	else                 *wheel_slot(md, b->expire) = b->wnext;
+	if (b->wnext != NIL) md->tab[b->wnext].wprev = b->wprev;
+
+	if (b->lprev != NIL) md->tab[b->lprev].lnext = b->lnext;
+	else                 md->lru_head = b->lnext;
+	if (b->lnext != NIL) md->tab[b->lnext].lprev = b->lprev;
+	else                 md->lru_tail = b->lprev;
+}
+
+/** Update list links after binding was moved to slot i */
+static void lists_moved(struct dnsdata *md, uint32_t i)
+{
+	struct binding *b = &md->tab[i];
+
+	if (b->wprev != NIL) md->tab[b->wprev].wnext = i;
+	else                 *wheel_slot(md, b->expire) = i;
+	if (b->wnext != NIL) md->tab[b->wnext].wprev = i;
+
+	if (b->lprev != NIL) md->tab[b->lprev].lnext = i;
+	else                 md->lru_head = i;
+	if (b->lnext != NIL) md->tab[b->lnext].lprev = i;
+	else                 md->lru_tail = i;
+}
+
+/** Find slot for given binding: either the binding or an empty slot */
+static inline uint32_t tab_find(struct dnsdata *md, const union addr *client, const union addr *server)
+{
+	uint32_t mask = md->tabsize - 1, i;
+	struct binding *b;
+
+	for (i = bhash(client, server) & mask;; i = (i + 1) & mask) {
+		b = &md->tab[i];
+		if (!b->name || (addr_eq(&b->client, client) && addr_eq(&b->server, server)))
+			return i;
+	}
+}
+
+/** Double the binding table size */
+static void tab_grow(struct dnsdata *md)
 {
-	struct client *client = ptr;
-	thash_free(client->servers);
+	struct binding *old = md->tab;
+	uint32_t i, j;
+
+	md->tabsize *= 2;
+	md->tab = mmatic_zalloc(md->mm, md->tabsize * sizeof(struct binding));
+
+	for (i = 0; i < DNS_WHEEL_SLOTS; i++)
+		md->wheel[i] = NIL;
+
+	/* re-insert from the least recently used, so that the LRU order is kept */
+	i = md->lru_tail;
+	md->lru_head = md->lru_tail = NIL;
+
+	for (; i != NIL; i = old[i].lprev) {
+		j = tab_find(md, &old[i].client, &old[i].server);
+		md->tab[j] = old[i];
+		lists_add(md, j);
+	}
+
+	mmatic_free(old);
+}
+
+/** Delete binding in given slot, shifting back the following ones (no tombstones) */
+static void tab_del(struct dnsdata *md, uint32_t i)
+{
+	uint32_t mask = md->tabsize - 1, j, home;
+
+	lists_del(md, i);
+
+	for (j = (i + 1) & mask; md->tab[j].name; j = (j + 1) & mask) {
+		home = bhash(&md->tab[j].client, &md->tab[j].server) & mask;
+
+		/* can it fill the hole at i? ie. is its home slot cyclically outside (i, j]? */
+		if ((i < j) ? (home <= i || home > j) : (home <= i && home > j)) {
+			md->tab[i] = md->tab[j];
+			lists_moved(md, i);
+			i = j;
+		}
+	}
+
+	memset(&md->tab[i], 0, sizeof(struct binding));
+	md->count--;
+}
+
+/** Remove expired bindings, at most DNS_GC_BUDGET per call: GC work is spread over packets */
+static void tab_expire(struct dnsdata *md, uint32_t now)
+{
+	uint32_t i, next;
+	union addr client, server;
+	int budget = DNS_GC_BUDGET;
+
+	if (!md->wheel_ts)
+		md->wheel_ts = now - now % DNS_WHEEL_RES;
+
+	/* long gap in the trace? the whole wheel is due */
+	if (now - md->wheel_ts > DNS_WHEEL_SLOTS * DNS_WHEEL_RES)
+		md->wheel_ts = now - DNS_WHEEL_SLOTS * DNS_WHEEL_RES;
+
+	/* process the slots that ended already */
+	while (md->wheel_ts + DNS_WHEEL_RES <= now) {
+		for (i = *wheel_slot(md, md->wheel_ts); i != NIL; i = next) {
+			next = md->tab[i].wnext;
+
+			/* due in next rounds of the wheel? */
+			if (md->tab[i].expire >= md->wheel_ts + DNS_WHEEL_RES)
+				continue;
+
+			if (budget-- == 0)
+				return;
+
+			/* NB: tab_del() may shift the next binding to another slot */
+			if (next != NIL) {
+				client = md->tab[next].client;
+				server = md->tab[next].server;
+				tab_del(md, i);
+				next = tab_find(md, &client, &server);
+			} else {
+				tab_del(md, i);
+			}
+		}
+
+		md->wheel_ts += DNS_WHEEL_RES;
+	}
+}
+
+/** Intern DNS name
+ * @return offset in names pool
+ * @retval 0 names pool full */
+static uint32_t name_intern(struct dnsdata *md, const char *name)
+{
+	uint32_t mask, i, len, *old, oldsize;
+
+	/* grow the index? */
+	if ((md->ncount + 1) * 4 > md->ntabsize * 3) {
+		old = md->ntab;
+		oldsize = md->ntabsize;
+
+		md->ntabsize *= 2;
+		md->ntab = mmatic_zalloc(md->mm, md->ntabsize * sizeof(uint32_t));
+
+		mask = md->ntabsize - 1;
+		for (len = 0; len < oldsize; len++) {
+			if (!old[len]) continue;
+			for (i = nhash(md->names + old[len]) & mask; md->ntab[i]; i = (i + 1) & mask);
+			md->ntab[i] = old[len];
+		}
+
+		mmatic_free(old);
+	}
+
+	/* already interned? */
+	mask = md->ntabsize - 1;
+	for (i = nhash(name) & mask; md->ntab[i]; i = (i + 1) & mask) {
+		if (streq(md->names + md->ntab[i], name))
+			return md->ntab[i];
+	}
+
+	/* append to the pool */
+	len = strlen(name) + 1;
+	if (md->names_len + len > md->names_max)
+		return 0;
+
+	while (md->names_len + len > md->names_size) {
+		md->names_size = MIN(md->names_size * 2, md->names_max);
+		md->names = mmatic_realloc(md->names, md->names_size);
+	}
+
+	memcpy(md->names + md->names_len, name, len);
+	md->ntab[i] = md->names_len;
+	md->names_len += len;
+	md->ncount++;
+
+	return md->ntab[i];
 }
-struct client *create_client(mmatic *mm)
+
+/** Rebuild the names pool, dropping names not used by any binding */
+static void names_gc(struct dnsdata *md)
 {
-	struct client *client;
-	client = mmatic_zalloc(mm, sizeof *client);
-	client->servers = thash_create_intkey(mmatic_free, mm);
-	return client;
+	char *old = md->names;
+	uint32_t i;
+
+	md->names = mmatic_alloc(md->mm, md->names_size);
+	md->names[0] = 0;
+	md->names_len = 1;
+
+	memset(md->ntab, 0, md->ntabsize * sizeof(uint32_t));
+	md->ncount = 0;
+
+	for (i = md->lru_head; i != NIL; i = md->tab[i].lnext)
+		md->tab[i].name = name_intern(md, old + md->tab[i].name);
+
+	mmatic_free(old);
 }
 
+/**************************** utility functions */
 bool is_dns(struct lfc_flow *flow)
 {
-	if (flow->proto != IPPROTO_UDP)
+	if (flow->proto != IPPROTO_UDP && flow->proto != IPPROTO_TCP)
 		return false;
 	if (flow->src.port != 53 && flow->dst.port != 53)
 		return false;
 
 	return true;
 }
-const char *parse_labels(uint8_t *buf, int rem, int *len)
+
+static inline uint16_t get16(const uint8_t *p)
 {
-	int i;
-	uint8_t ll;
-	static char name[512];
-	char *nptr = name;
+	return (p[0] << 8) | p[1];
+}
 
-	if (rem <= 0 || rem > 512) return NULL;
+static inline uint32_t get32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
 
-	name[0] = 0;
-	*len = 0;
+/** Go to the next label of a name, following compression pointers
+ * @param off    label offset, updated
+ * @param hops   number of pointers followed so far, updated
+ * @return label length, 0 for the root label, -1 on error */
+static inline int label_get(const uint8_t *msg, int len, int *off, int *hops)
+{
+	int ll;
+
+	while (*off < len) {
+		ll = msg[*off];
+
+		if ((ll & 0xc0) == 0xc0) {
+			if (*off + 1 >= len || ++(*hops) > DNS_MAXHOPS) return -1;
+			*off = ((ll & 0x3f) << 8) | msg[*off + 1];
+		} else if (ll & 0xc0) {
+			return -1; /* reserved label type */
+		} else if (*off + 1 + ll > len) {
+			return -1; /* truncated */
+		} else {
+			return ll;
+		}
+	}
+
+	return -1;
+}
+
+/** Skip name in place, without following compression pointers
+ * @return offset right after the name, -1 on error */
+static int name_skip(const uint8_t *msg, int len, int off)
+{
+	int ll;
+
+	while (off < len) {
+		ll = msg[off];
+
+		if (ll == 0)
+			return off + 1;
+		else if ((ll & 0xc0) == 0xc0)
+			return (off + 2 <= len) ? off + 2 : -1;
+		else if (ll & 0xc0)
+			return -1;
+
+		off += 1 + ll;
+	}
+
+	return -1;
+}
+
+static inline uint8_t lower(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/** Compare 2 names in the message, case-insensitive */
+static bool name_eq(const uint8_t *msg, int len, int a, int b)
+{
+	int la, lb, ha = 0, hb = 0, i;
 
 	while (true) {
-		ll = buf[0];
-		if (ll == 0) {
-			*len += 1;
-			break;
-		} else if ((ll & 0xc0) == 0xc0) {
-			*len += 2;
-			break;
+		la = label_get(msg, len, &a, &ha);
+		lb = label_get(msg, len, &b, &hb);
+		if (la < 0 || lb < 0 || la != lb) return false;
+
+		/* the same suffix? */
+		if (a == b) return true;
+		if (la == 0) return true;
+
+		for (i = 1; i <= la; i++) {
+			if (lower(msg[a + i]) != lower(msg[b + i]))
+				return false;
 		}
 
-#define BUF_MOVE(l) \
-		{ buf += (l); rem -= (l); *len += (l); if (rem <= 0) return NULL; }
+		a += 1 + la;
+		b += 1 + la;
+	}
+}
+
+/** Write name in the message as text
+ * @param size   out size
+ * @retval false invalid name or too long */
+static bool name_text(const uint8_t *msg, int len, int off, char *out, int size)
+{
+	int ll, hops = 0, n = 0;
+
+	while ((ll = label_get(msg, len, &off, &hops)) > 0) {
+		if (n + ll + 1 >= size) return false;
 
-		BUF_MOVE(1);
-		for (i = 0; i < ll && i < rem; i++)
-			*nptr++ = buf[i];
-		*nptr++ = '.';
-		BUF_MOVE(ll);
+		if (n > 0) out[n++] = '.';
+		memcpy(out + n, msg + off + 1, ll);
+		n += ll;
+		off += 1 + ll;
 	}
 
-	if (nptr > name) nptr[-1] = 0;
-	return name;
+	out[n] = 0;
+	return ll == 0;
 }
+
 bool is_interesting(uint16_t type, uint16_t class)
 {
 	if (class != 1) return false;
 
 	if (type ==  1) return true; /* A */
 	if (type == 15) return true; /* MX */
+	if (type == 28) return true; /* AAAA */
 
 	return false;
 }
 
-void gcrun(struct dnsdata *md, double ts)
+/** Set DNS binding
+ * @param expire   expiry timestamp [s] */
+static void db_set(struct dnsdata *md, const union addr *client, const union addr *server,
+	const char *dns_name, uint32_t expire)
 {
-	struct client *cl;
-	unsigned long key;
-	double min_ts;
+	struct binding *b;
+	uint32_t i, name;
+
+	/* intern the name first: it may evict bindings */
+	name = name_intern(md, dns_name);
+	if (!name) {
+		names_gc(md);
+
+		/* still too big? evict the least recently used half */
+		if (md->names_len > md->names_max / 2) {
+			for (i = md->count / 2; i > 0; i--)
+				tab_del(md, md->lru_tail);
+			names_gc(md);
+		}
 
-	min_ts = ts - DNS_BACKLOG;
+		name = name_intern(md, dns_name);
+		if (!name) return; /* name longer than the pool limit */
+	}
+
+	i = tab_find(md, client, server);
+	if (md->tab[i].name) {
+		lists_del(md, i);
+	} else {
+		/* make room */
+		if (md->count >= md->maxcount) {
+			tab_del(md, md->lru_tail);
+			i = tab_find(md, client, server);
+		} else if ((md->count + 1) * 4 > md->tabsize * 3) {
+			tab_grow(md);
+			i = tab_find(md, client, server);
+		}
 
-	thash_reset(md->clients);
-	while ((cl = thash_uint_iter(md->clients, &key))) {
-		if (cl->ts < min_ts)
-			thash_uint_set(md->clients, key, NULL);
+		md->tab[i].client = *client;
+		md->tab[i].server = *server;
+		md->count++;
 	}
 
-	md->gcstamp = ts + 1800.0; /* run again in 30 minutes */
+	/* update DNS binding */
+	b = &md->tab[i];
+	b->name = name;
+	b->expire = expire;
+	lists_add(md, i);
 }
 
-void db_add(struct dnsdata *md, struct in_addr client_addr,
-	struct in_addr server_addr, const char *dns_name, double ts)
+/** Add or refresh a DNS binding
+ * @param ttl   DNS record TTL [s] */
+void db_add(struct dnsdata *md, const union addr *client, const union addr *server,
+	const char *dns_name, double ts, uint32_t ttl)
 {
-	struct client *cl;
-
-	/* run GC */
-	if (!md->gcstamp || ts > md->gcstamp)
-		gcrun(md, ts);
-
-	/* get client */
-	cl = thash_uint_get(md->clients, client_addr.s_addr);
-	if (!cl) {
-		cl = create_client(md->mm);
-		thash_uint_set(md->clients, client_addr.s_addr, cl);
-	}
+	/* track number of clients */
+	if (!md->client.w64[0] && !md->client.w64[1])
+		md->client = *client;
+	else if (!addr_eq(&md->client, client))
+		md->multi = true;
 
-	/* update DNS binding */
-	thash_uint_set(cl->servers, server_addr.s_addr, mmatic_strdup(md->mm, dns_name));
-	cl->ts = ts;
+	db_set(md, client, server, dns_name, ts + MIN(MAX(ttl, DNS_MINTTL), DNS_BACKLOG));
 }
 
-/** Find DNS name for given flow */
-const char *find_name(struct dnsdata *md, struct in_addr client_addr, struct in_addr server_addr)
+/** Find DNS name for given flow
+ * @param now   current timestamp: ignore expired bindings not collected yet */
+const char *find_name(struct dnsdata *md, const union addr *client, const union addr *server,
+	double now)
 {
-	struct client *cl;
+	uint32_t i;
 
-	cl = thash_uint_get(md->clients, client_addr.s_addr);
-	if (!cl)
+	i = tab_find(md, client, server);
+	if (!md->tab[i].name || md->tab[i].expire < now)
 		return NULL;
 
-	return thash_uint_get(cl->servers, server_addr.s_addr);
+	/* mark as recently used */
+	lists_del(md, i);
+	lists_add(md, i);
+
+	return md->names + md->tab[i].name;
 }
 
-void flow_assign_name(struct dnsdata *md, struct lfc_flow *flow, struct flowdata *fd)
+void flow_assign_name(struct dnsdata *md, struct lfc_flow *flow, struct flowdata *fd, double now)
 {
 	const char *name;
+	union addr src, dst;
+	char buf1[INET6_ADDRSTRLEN], buf2[INET6_ADDRSTRLEN];
+
+	addr_flow(&src, flow, &flow->src);
+	addr_flow(&dst, flow, &flow->dst);
 
-	name = find_name(md, flow->src.addr.ip4, flow->dst.addr.ip4);
+	name = find_name(md, &src, &dst, now);
 	if (!name)
-		name = find_name(md, flow->dst.addr.ip4, flow->src.addr.ip4);
+		name = find_name(md, &dst, &src, now);
 
 	/* special case: trace collected on local computer? */
-	if (!name && thash_count(md->clients) == 1) {
-		struct in_addr loop;
-		loop.s_addr = htonl(0x7F000001); /* 127.0.0.1 */
+	if (!name && !md->multi && (md->client.w64[0] || md->client.w64[1])) {
+		union addr loop;
+
+		if (flow->is_ip6) {
+			memset(&loop, 0, sizeof loop);
+			loop.b[15] = 1;                     /* ::1 */
+		} else {
+			loop.w64[0] = 0;
+			loop.w32[2] = htonl(0xffff);
+			loop.w32[3] = htonl(0x7F000001);    /* 127.0.0.1 */
+		}
 
-		name = find_name(md, loop, flow->dst.addr.ip4);
+		name = find_name(md, &loop, &dst, now);
 		if (!name)
-			name = find_name(md, loop, flow->src.addr.ip4);
+			name = find_name(md, &loop, &src, now);
 	}
 
 	if (name) {
 		strncpy(fd->name, name, sizeof(fd->name));
 		fd->name[sizeof(fd->name)-1] = 0;
-	} else {
-		dbg(3, "dns: no name for flow src=%s ", inet_ntoa(flow->src.addr.ip4));
-		dbg(3, "dst=%s\n", inet_ntoa(flow->dst.addr.ip4));
+	} else if (debug >= 3) {
+		dbg(3, "dns: no name for flow src=%s dst=%s\n",
+			addr_ntop(&src, buf1, sizeof buf1), addr_ntop(&dst, buf2, sizeof buf2));
+	}
+}
+
+/** Parse DNS response in place and add bindings for the queried name */
+static void msg_parse(struct dnsdata *md, struct flowdata *fd, const union addr *client,
+	const uint8_t *msg, int len, double ts)
+{
+	struct answer ans[DNS_MAXANS];
+	struct alias chain[DNS_MAXCHAIN];
+	union addr server;
+	char dns_name[256], buf1[INET6_ADDRSTRLEN], buf2[INET6_ADDRSTRLEN];
+	int off, i, j, nans, nchain, ancount;
+	uint16_t type, class, rdlen;
+	bool named = false;
+
+	/* name offsets are 16-bit */
+	if (len > UINT16_MAX) len = UINT16_MAX;
+	if (len < 12) return;
+
+	/* successful response to a standard query, with 1 question and some answers? */
+	if (!(msg[2] & 0x80) || ((msg[2] >> 3) & 0x0f) != 0 || (msg[3] & 0x0f) != 0)
+		return;
+	if (get16(msg + 4) != 1)
+		return;
+	ancount = get16(msg + 6);
+	if (ancount == 0)
+		return;
+
+	/* assume being here is enough to assure it's a DNS reply packet */
+	fd->dns_found = true;
+
+	/*
+	 * the question
+	 */
+	off = name_skip(msg, len, 12);
+	if (off < 0 || off + 4 > len) return; /* truncated? */
+
+	type  = get16(msg + off);
+	class = get16(msg + off + 2);
+	if (!is_interesting(type, class)) return;
+	off += 4;
+
+	/*
+	 * the answers: pick CNAME, A and AAAA records
+	 */
+	nans = 0;
+	for (i = 0; i < ancount && nans < DNS_MAXANS; i++) {
+		ans[nans].owner = off;
+
+		off = name_skip(msg, len, off);
+		if (off < 0 || off + 10 > len) break; /* truncated? */
+
+		type  = get16(msg + off);
+		class = get16(msg + off + 2);
+		rdlen = get16(msg + off + 8);
+		if (off + 10 + rdlen > len) break; /* truncated? */
+
+		ans[nans].type  = type;
+		ans[nans].ttl   = get32(msg + off + 4);
+		ans[nans].rdoff = off + 10;
+		ans[nans].rdlen = rdlen;
+		off += 10 + rdlen;
+
+		if (class != 1) continue;
+		if (type == 5 || (type == 1 && rdlen == 4) || (type == 28 && rdlen == 16))
+			nans++;
+	}
+
+	/*
+	 * follow the CNAME chain of the queried name
+	 */
+	chain[0].name = 12;
+	chain[0].ttl = UINT32_MAX;
+	nchain = 1;
+
+	for (i = 0; i < nchain; i++) {
+		for (j = 0; j < nans && nchain < DNS_MAXCHAIN; j++) {
+			if (ans[j].type != 5) continue;
+			if (!name_eq(msg, len, ans[j].owner, chain[i].name)) continue;
+
+			chain[nchain].name = ans[j].rdoff;
+			chain[nchain].ttl = MIN(chain[i].ttl, ans[j].ttl);
+			nchain++;
+
+			ans[j].type = 0; /* use each CNAME once: no loops */
+		}
+	}
+
+	/*
+	 * bind addresses of the chain names to the queried name
+	 */
+	for (j = 0; j < nans; j++) {
+		if (ans[j].type != 1 && ans[j].type != 28) continue;
+
+		for (i = 0; i < nchain; i++) {
+			if (name_eq(msg, len, ans[j].owner, chain[i].name))
+				break;
+		}
+		if (i == nchain) continue;
+
+		/* the only copy: the queried name, once per message */
+		if (!named) {
+			if (!name_text(msg, len, 12, dns_name, sizeof dns_name)) return;
+			named = true;
+		}
+
+		if (ans[j].type == 1)
+			addr_set4(&server, msg + ans[j].rdoff);
+		else
+			addr_set6(&server, msg + ans[j].rdoff);
+
+		/* add to the database! */
+		db_add(md, client, &server, dns_name, ts, MIN(chain[i].ttl, ans[j].ttl));
+		if (debug >= 3) {
+			dbg(3, "dns: %.6f client=%s server=%s dns_name=%s\n", ts,
+				addr_ntop(client, buf1, sizeof buf1),
+				addr_ntop(&server, buf2, sizeof buf2), dns_name);
+		}
 	}
 }
 
+/** Parse DNS over TCP: messages prefixed with 2-byte length, possibly split over segments */
+static void tcp_parse(struct dnsdata *md, struct flowdata *fd, const union addr *client,
+	const uint8_t *data, int len, double ts)
+{
+	uint32_t n;
+
+	while (len > 0) {
+		/* continue a partial message? */
+		if (fd->tcpbuf) {
+			if (!fd->tcpneed) {
+				fd->tcpbuf[fd->tcplen++] = *data++;
+				len--;
+				fd->tcpneed = 2 + get16(fd->tcpbuf);
+				continue;
+			}
+
+			n = MIN(len, fd->tcpneed - fd->tcplen);
+			memcpy(fd->tcpbuf + fd->tcplen, data, n);
+			fd->tcplen += n;
+			data += n; len -= n;
+
+			if (fd->tcplen == fd->tcpneed) {
+				msg_parse(md, fd, client, fd->tcpbuf + 2, fd->tcplen - 2, ts);
+				mmatic_free(fd->tcpbuf);
+				fd->tcpbuf = NULL;
+				fd->tcplen = fd->tcpneed = 0;
+			}
+			continue;
+		}
+
+		/* a complete message in this segment: parse in place */
+		if (len >= 2 && len >= 2 + get16(data)) {
+			n = get16(data);
+			msg_parse(md, fd, client, data + 2, n, ts);
+			data += 2 + n; len -= 2 + n;
+			continue;
+		}
+
+		/* the message continues in next segments: keep a copy */
+		fd->tcpneed = (len >= 2) ? 2 + get16(data) : 0;
+		fd->tcpbuf = mmatic_alloc(md->mm, fd->tcpneed ? fd->tcpneed : 2 + UINT16_MAX);
+		memcpy(fd->tcpbuf, data, len);
+		fd->tcplen = len;
+		len = 0;
+	}
+}
+
+/**************************** snapshot */
+
+/** FNV-1a over 32-bit words */
+static uint32_t checksum(const uint8_t *buf, size_t len)
+{
+	uint32_t h = 2166136261U, w;
+	size_t i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		memcpy(&w, buf + i, 4);
+		h = (h ^ w) * 16777619U;
+	}
+	for (; i < len; i++)
+		h = (h ^ buf[i]) * 16777619U;
+
+	return h;
+}
+
+/** Check snapshot file read from disk
+ * @param size  file size */
+static bool snap_check(const struct snap_hdr *hdr, size_t size)
+{
+	const struct snap_rec *rec;
+	const char *names;
+	uint32_t i;
+
+	if (size < sizeof *hdr) return false;
+	if (memcmp(hdr->magic, SNAP_MAGIC, sizeof hdr->magic) != 0) return false;
+	if (hdr->version != SNAP_VERSION) return false;
+	if (hdr->size != size) return false;
+	if (hdr->names_len == 0) return false;
+	if (sizeof *hdr + (uint64_t) hdr->count * sizeof *rec + hdr->names_len != size) return false;
+
+	if (hdr->checksum != checksum((uint8_t *) hdr + sizeof *hdr, size - sizeof *hdr)) return false;
+
+	rec = (const void *) (hdr + 1);
+	names = (const char *) (rec + hdr->count);
+	if (names[hdr->names_len - 1] != 0) return false;
+
+	for (i = 0; i < hdr->count; i++) {
+		if (rec[i].name == 0 || rec[i].name >= hdr->names_len) return false;
+	}
+
+	return true;
+}
+
+/** Load bindings from the snapshot file, if any */
+static void snap_load(struct dnsdata *md, const char *path)
+{
+	struct stat st;
+	struct snap_hdr *hdr;
+	const struct snap_rec *rec;
+	const char *names;
+	uint32_t i, loaded = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof *hdr) {
+		close(fd);
+		return;
+	}
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return;
+
+	if (!snap_check(hdr, st.st_size)) {
+		dbg(1, "dns: ignoring invalid snapshot file %s\n", path);
+		munmap(hdr, st.st_size);
+		return;
+	}
+
+	/* re-insert from the least recently used, skipping bindings expired already */
+	rec = (const void *) (hdr + 1);
+	names = (const char *) (rec + hdr->count);
+	for (i = 0; i < hdr->count; i++) {
+		if (rec[i].expire < hdr->now) continue;
+		db_set(md, &rec[i].client, &rec[i].server, names + rec[i].name, rec[i].expire);
+		loaded++;
+	}
+
+	md->client = hdr->client;
+	md->multi = hdr->multi;
+	md->now = hdr->now;
+	md->wheel_ts = hdr->wheel_ts;
+
+	dbg(1, "dns: loaded %u bindings from %s\n", loaded, path);
+	munmap(hdr, st.st_size);
+}
+
+/** Write bindings to the snapshot file (best effort) */
+static void snap_save(struct dnsdata *md, const char *path)
+{
+	struct snap_hdr *hdr;
+	struct snap_rec *rec;
+	struct binding *b;
+	char *names, *tmp;
+	uint32_t i, count;
+	size_t size;
+	FILE *fp;
+	bool ok;
+
+	/* drop names no longer used */
+	names_gc(md);
+
+	size = sizeof *hdr + (size_t) md->count * sizeof *rec + md->names_len;
+	hdr = mmatic_zalloc(md->mm, size);
+	rec = (void *) (hdr + 1);
+
+	count = 0;
+	for (i = md->lru_tail; i != NIL; i = b->lprev) {
+		b = &md->tab[i];
+		if (b->expire < md->now) continue;
+
+		rec[count].client = b->client;
+		rec[count].server = b->server;
+		rec[count].name = b->name;
+		rec[count].expire = b->expire;
+		count++;
+	}
+
+	names = (char *) (rec + count);
+	memcpy(names, md->names, md->names_len);
+	size = names + md->names_len - (char *) hdr;
+
+	memcpy(hdr->magic, SNAP_MAGIC, sizeof hdr->magic);
+	hdr->version = SNAP_VERSION;
+	hdr->size = size;
+	hdr->count = count;
+	hdr->names_len = md->names_len;
+	hdr->now = md->now;
+	hdr->wheel_ts = md->wheel_ts;
+	hdr->client = md->client;
+	hdr->multi = md->multi;
+	hdr->checksum = checksum((uint8_t *) hdr + sizeof *hdr, size - sizeof *hdr);
+
+	/* write to a temporary file first: the snapshot may be in use by a parallel run */
+	tmp = mmatic_sprintf(md->mm, "%s.%d", path, getpid());
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		dbg(1, "dns: could not write snapshot file %s: %m\n", tmp);
+		mmatic_free(hdr);
+		return;
+	}
+
+	ok = (fwrite(hdr, size, 1, fp) == 1);
+	ok = (fclose(fp) == 0) && ok;
+	if (!ok || rename(tmp, path) != 0) {
+		dbg(1, "dns: could not write snapshot file %s: %m\n", path);
+		unlink(tmp);
+	}
+
+	mmatic_free(tmp);
+	mmatic_free(hdr);
+}
+
 /**************************** main code */
 
+static struct fc_str *attr_name;
+
 void header()
 {
 	printf("%%%% dns 0.1\n");
 	printf("%% dns_flow: is a DNS flow?\n");
 	printf("%% dns_name: DNS domain name\n");
 	printf("@attribute dns_flow numeric\n");
-	printf("@attribute dns_name string\n");
+	fc_str_header(attr_name);
 }
 
 bool init(struct lfc *lfc, void **mydata, struct flowcalc *fc)
 {
 	struct dnsdata *md;
+	const char *opt;
+	uint64_t maxmem;
+	uint32_t i;
 
 	md = mmatic_zalloc(lfc->mm, sizeof *md);
 	md->mm = lfc->mm;
-	md->clients = thash_create_intkey(free_client, md->mm);
+
+	/* memory limit: half for the binding table, a quarter for DNS names */
+	opt = thash_get(fc->opts, "dns_maxmem");
+	maxmem = (opt ? strtoul(opt, NULL, 10) : DNS_MAXMEM) << 20;
+	if (maxmem < (1 << 20)) {
+		dbg(0, "dns: dns_maxmem must be at least 1 [MB]\n");
+		return false;
+	}
+
+	for (md->maxsize = 4; md->maxsize < (1U << 30)
+		&& md->maxsize * 2 * sizeof(struct binding) <= maxmem / 2; md->maxsize *= 2);
+	md->maxcount = md->maxsize / 4 * 3;
+	md->names_max = MIN(maxmem / 4, UINT32_MAX);
+
+	md->tabsize = MIN(DNS_TABSIZE, md->maxsize);
+	md->tab = mmatic_zalloc(md->mm, md->tabsize * sizeof(struct binding));
+
+	for (i = 0; i < DNS_WHEEL_SLOTS; i++)
+		md->wheel[i] = NIL;
+	md->lru_head = md->lru_tail = NIL;
+
+	md->ntabsize = 1024;
+	md->ntab = mmatic_zalloc(md->mm, md->ntabsize * sizeof(uint32_t));
+	md->names_size = MIN(65536, md->names_max);
+	md->names = mmatic_alloc(md->mm, md->names_size);
+	md->names[0] = 0;
+	md->names_len = 1; /* offset 0 means "no name" */
+
+	/* warm start: bindings from the previous run */
+	md->snapshot = thash_get(fc->opts, "dns_snapshot");
+	if (md->snapshot)
+		snap_load(md, md->snapshot);
+
+	attr_name = fc_str_attr("dns_name");
 
 	*mydata = md;
 	return true;
@@ -208,6 +1088,10 @@ void pkt(struct lfc *lfc, void *plugin,
 	struct dnsdata *md = plugin;
 	struct flowdata *fd = data;
 
+	/* expire old bindings */
+	md->now = pkt->ts;
+	tab_expire(md, md->now);
+
 	/*
 	 * is the flow a DNS one?
 	 */
@@ -215,7 +1099,7 @@ void pkt(struct lfc *lfc, void *plugin,
 		fd->is_dns = is_dns(flow);
 
 		if (!fd->is_dns) {
-			flow_assign_name(md, flow, fd);
+			flow_assign_name(md, flow, fd, pkt->ts);
 			return;
 		}
 	} else if (!fd->is_dns) {
@@ -223,116 +1107,53 @@ void pkt(struct lfc *lfc, void *plugin,
 	}
 
 	/*
-	 * if it is a meaningful IPv4 DNS response packet,
-	 * then parse the DNS header
-	 */
-	if (!pkt->ip4  || !pkt->udp || pkt->sport != 53) return;
-	if (!pkt->data || pkt->len <= 34) return;
-
-	uint8_t *buf;
-	uint8_t opcode, qr, rcode;
-	uint16_t alen;
-
-	buf    = (uint8_t *) pkt->data;
-	qr     = buf[2] >> 7;
-	opcode = (buf[2] >> 3) & 0x0f;
-	rcode  = buf[3] & 0x0f;
-	alen   = ntohs(*((uint16_t *) (buf + 6)));
-
-	if (!((qr == 1) && (opcode == 0) && (rcode == 0) && (alen > 0)))
-		return; /* nothing interesting/supported in this packet */
-
-	/* assume being here is enough to assure it's a DNS reply packet */
-	fd->dns_found = true;
-
-	/*
-	 * parse the DNS query
-	 */
-	int len, left;
-	char dns_name[512];
-	const char *name;
-	uint16_t type, class;
-
-	buf += 12; left = pkt->len - 12;
-	name = parse_labels(buf, left, &len);
-	if (!name) return;    /* truncated? */
-	else       strncpy(dns_name, name, sizeof dns_name);
-
-	buf += len; left -= len;
-	if (left < 4) return; /* truncated? */
-
-	type  = ntohs(*((uint16_t *) (buf + 0)));
-	class = ntohs(*((uint16_t *) (buf + 2)));
-	if (!is_interesting(type, class)) return;
-	buf += 4; left -= 4;
-
-	/*
-	 * parse the DNS answers
+	 * if it is a DNS response, parse it
 	 */
-	int aid;
-	uint16_t rdlen;
-	struct in_addr server_addr;
-
-	for (aid = 0; aid < alen; aid++) {
-		/* ignore labels... */
-		if (!parse_labels(buf, left, &len)) return; /* truncated? */
-		buf += len; left -= len;
-		if (left < 4) return; /* truncated? */
-
-		/* check Type and Class */
-		type  = ntohs(*((uint16_t *) (buf + 0)));
-		class = ntohs(*((uint16_t *) (buf + 2)));
-		buf += 4; left -= 4;
-
-		/* skip TTL */
-		buf += 4; left -= 4;
-		if (left < 2) return; /* truncated? */
-
-		/* read rdata length */
-		rdlen = ntohs(*((uint16_t *) (buf + 0)));
-		buf += 2; left -= 2;
-
-		/* is there an IPv4 address in the answer? */
-		if (!is_interesting(type, class) || rdlen != 4) {
-			/* skip */
-			buf += rdlen; left -= rdlen;
-			continue;
-		}
+	if (pkt->sport != 53 || !pkt->data || pkt->len == 0) return;
+	if (!pkt->ip4 && !pkt->ip6) return;
 
-		/******************************************/
-		if (left < rdlen) return; /* truncated? */
-		server_addr.s_addr = *((unsigned long *) buf);
-		buf += rdlen; left -= rdlen;
-
-		/* add to the database! */
-		db_add(md, pkt->ip4->ip_dst, server_addr, dns_name, pkt->ts);
-		dbg(3, "dns: %.6f client=%s ", pkt->ts, inet_ntoa(pkt->ip4->ip_dst));
-		dbg(3, "server=%s dns_name=%s\n", inet_ntoa(server_addr), dns_name);
-	}
+	union addr client;
 
-	return;
+	if (pkt->ip4)
+		addr_set4(&client, &pkt->ip4->ip_dst);
+	else
+		addr_set6(&client, &pkt->ip6->ip_dst);
 
+	if (pkt->udp)
+		msg_parse(md, fd, &client, pkt->data, pkt->len, pkt->ts);
+	else if (pkt->tcp && !pkt->dup)
+		tcp_parse(md, fd, &client, pkt->data, pkt->len, pkt->ts);
 }
 
 void flow(struct lfc *lfc, void *plugin, struct lfc_flow *flow, void *data)
 {
 	struct flowdata *fd = data;
 
+	if (fd->tcpbuf)
+		mmatic_free(fd->tcpbuf);
+
 	if (fd->is_dns)
-		printf(",1");
+		fc_val("1");
 	else
-		printf(",0");
+		fc_def(1, "0");
 
-	if (fd->name[0])
-		printf(",%s", fd->name);
-	else
-		printf(",?dns_name");
+	fc_str(attr_name, fd->name[0] ? fd->name : NULL);
+}
+
+void finish(struct lfc *lfc, void *plugin, struct flowcalc *fc)
+{
+	struct dnsdata *md = plugin;
+
+	if (md->snapshot)
+		snap_save(md, md->snapshot);
 }
 
 struct module module = {
 	.size = sizeof(struct flowdata),
 	.init = init,
 	.header = header,
+	.finish = finish,
 	.pkt  = pkt,
+	.uses = FC_USES_PAYLOAD,
 	.flow = flow
 };
@@ -26,11 +26,57 @@
 #include <time.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <unistd.h>
 
 #include <libpjf/main.h>
 #include <libflowcalc.h>
 
 #include "flowcalc.h"
+#include "zout.h"
+#include "zin.h"
+
+/** A loaded module */
+struct plugin {
+	const char *name;     /**> module name */
+	struct module *mod;   /**> module */
+	void *pdata;          /**> module plugin data */
+};
+
+/** String attribute, see fc_str() */
+struct fc_str {
+	const char *name;     /**> attribute name */
+	thash *codes;         /**> value -> struct strval */
+	tlist *values;        /**> list of struct strval, in code order */
+	const char *val;      /**> value written in row number row, see fc_str_get() */
+	unsigned long row;    /**> see val */
+};
+
+/** Interned value of a string attribute */
+struct strval {
+	unsigned long code;   /**> nominal code */
+	const char *label;    /**> value, quoted for ARFF if needed */
+};
+
+/** Flow data of flowcalc itself */
+struct fcflow {
+	int64_t first;        /**> timestamp of first packet [ns] */
+	int64_t last;         /**> timestamp of last packet [ns] */
+};
+
+/** ARFF row output state, see fc_val() */
+static struct {
+	mmatic *mm;           /**> memory */
+	bool sparse;          /**> write sparse rows? */
+	bool nominal;         /**> write string attributes as nominal? */
+	FILE *dict;           /**> write codes of string attributes, dictionary to this file */
+	int idx;              /**> index of next attribute in current row */
+	int cnt;              /**> number of values written in current row */
+	struct fcflow *flow;  /**> current flow */
+	unsigned long row;    /**> current row number */
+	thash *attrs;         /**> string attributes: name -> struct fc_str */
+} out;
 
 /** Prints usage help screen */
 static void help(void)
@@ -43,6 +89,15 @@ static void help(void)
 	printf("  -f \"<filter>\"          apply given packet filter on the input file\n");
 	printf("  -r <string>            set ARFF @relation to given string\n");
 	printf("  -H                     skip ARFF header\n");
+	printf("  -s                     write sparse ARFF rows\n");
+	printf("  -N                     write string attributes as nominal (header goes last)\n");
+	printf("  -D <file>              write string attributes as codes, dictionary to <file>\n");
+	printf("  -z <method>[:<level>]  compress output: zstd or gzip (e.g. zstd:3)\n");
+	printf("  -j <threads>           number of compression threads [number of CPUs]\n");
+	printf("  -R                     let libtrace read the trace file directly (no read-ahead)\n");
+	printf("  -I                     strip link headers (VLAN, MPLS, PPPoE...), keep TCP/UDP over IP\n");
+	printf("  -T                     take inner packets out of GRE and VXLAN tunnels (implies -I)\n");
+	printf("  -C                     drop IPv4 packets with bad header checksum\n");
 	printf("  -d <dir>               directory to look for modules in [%s]\n", MYDIR);
 	printf("  -e <modules>           comma-separated list of modules to enable\n");
 	printf("  -l                     list available modules\n");
@@ -51,6 +106,7 @@ static void help(void)
 	printf("  -c                     skip TCP flows that did not close properly\n");
 	printf("  -n <packets>           limit statistics to first n packets (e.g. 3)\n");
 	printf("  -t <time>              limit statistics to first <time> seconds (e.g. 1.5)\n");
+	printf("  -o <name>=<value>      set module option (may be given many times)\n");
 	printf("  --verbose,-V           be verbose (alias for --debug=5)\n");
 	printf("  --debug=<num>          set debugging level\n");
 	printf("  --help,-h              show this usage help screen\n");
@@ -78,7 +134,7 @@ static int parse_argv(struct flowcalc *fc, int argc, char *argv[])
 	int i, c;
 	char *d, *s;
 
-	static char *short_opts = "hvVf:r:d:e:an:t:lHbc";
+	static char *short_opts = "hvVf:r:d:e:an:t:lHbco:sND:z:j:RITC";
 	static struct option long_opts[] = {
 		/* name, has_arg, NULL, short_ch */
 		{ "verbose",    0, NULL,  1  },
@@ -123,6 +179,23 @@ static int parse_argv(struct flowcalc *fc, int argc, char *argv[])
 			case 'H': fc->nohead = true; break;
 			case 'b': fc->noloss = true; break;
 			case 'c': fc->reqclose = true; break;
+			case 's': fc->sparse = true; break;
+			case 'N': fc->nominal = true; break;
+			case 'D': fc->dict = mmatic_strdup(fc->mm, optarg); break;
+			case 'z': fc->zout = mmatic_strdup(fc->mm, optarg); break;
+			case 'j': fc->zthreads = atoi(optarg); break;
+			case 'R': fc->direct = true; break;
+			case 'I': fc->decap = true; break;
+			case 'T': fc->decap = fc->tunnel = true; break;
+			case 'C': fc->csum = true; break;
+			case 'o':
+				s = mmatic_strdup(fc->mm, optarg);
+				d = strchr(s, '=');
+				if (!d)
+					die("Invalid module option '%s': expected <name>=<value>\n", optarg);
+				*d = 0;
+				thash_set(fc->opts, s, d + 1);
+				break;
 			default: help(); return 1;
 		}
 	}
@@ -132,6 +205,16 @@ static int parse_argv(struct flowcalc *fc, int argc, char *argv[])
 		return 0;
 	}
 
+	if (fc->nominal && fc->dict) {
+		fprintf(stderr, "Options -N and -D are mutually exclusive\n");
+		return 1;
+	}
+
+	if (fc->direct && (fc->decap || fc->csum)) {
+		fprintf(stderr, "Options -I, -T and -C cannot be used with -R\n");
+		return 1;
+	}
+
 	if (argc - optind > 0) {
 		fc->file = mmatic_strdup(fc->mm, argv[optind]);
 	} else {
@@ -142,8 +225,10 @@ static int parse_argv(struct flowcalc *fc, int argc, char *argv[])
 	return 0;
 }
 
-static void header(struct flowcalc *fc)
+static void header(struct flowcalc *fc, tlist *plugins)
 {
+	struct plugin *pl;
+
 	time_t now;
 	const char *name;
 
@@ -182,20 +267,221 @@ static void header(struct flowcalc *fc)
 	printf("@attribute fc_dst_addr string\n");
 	printf("@attribute fc_dst_port numeric\n");
 	printf("\n");
+
+	tlist_iter_loop(plugins, pl) {
+		if (pl->mod->header) {
+			pl->mod->header(fc->lfc, pl->pdata, fc);
+			printf("\n");
+		}
+	}
+
+	printf("@data\n");
+}
+
+void fc_val(const char *fmt, ...)
+{
+	va_list args;
+
+	if (out.sparse)
+		printf(out.cnt ? ",%d " : "%d ", out.idx);
+	else if (out.idx)
+		putchar(',');
+
+	out.idx++;
+	out.cnt++;
+
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+}
+
+void fc_def(int n, const char *def)
+{
+	/* WEKA sparse format: missing values are 0 */
+	if (out.sparse && streq(def, "0")) {
+		out.idx += n;
+		return;
+	}
+
+	for (; n > 0; n--)
+		fc_val("%s", def);
+}
+
+/** Quote value for ARFF, if needed */
+static char *quote(const char *val)
+{
+	char *ret, *d;
+
+	if (val[0] && !val[strcspn(val, " \t\r\n,{}'\"%\\")] && !streq(val, "?"))
+		return mmatic_strdup(out.mm, val);
+
+	ret = d = mmatic_alloc(out.mm, 2 * strlen(val) + 3);
+	*d++ = '\'';
+	for (; *val; val++) {
+		if (*val == '\'' || *val == '\\')
+			*d++ = '\\';
+		*d++ = *val;
+	}
+	*d++ = '\'';
+	*d = 0;
+
+	return ret;
+}
+
+struct fc_str *fc_str_attr(const char *name)
+{
+	struct fc_str *attr;
+
+	attr = mmatic_zalloc(out.mm, sizeof *attr);
+	attr->name = mmatic_strdup(out.mm, name);
+	attr->codes = thash_create_strkey(NULL, out.mm);
+	attr->values = tlist_create(NULL, out.mm);
+	thash_set(out.attrs, attr->name, attr);
+
+	return attr;
+}
+
+void fc_str_header(struct fc_str *attr)
+{
+	struct strval *sv;
+
+	if (out.nominal && tlist_count(attr->values) > 0) {
+		printf("@attribute %s {", attr->name);
+		tlist_iter_loop(attr->values, sv)
+			printf(sv->code ? ",%s" : "%s", sv->label);
+		printf("}\n");
+	} else if (out.dict) {
+		printf("@attribute %s numeric\n", attr->name);
+	} else {
+		printf("@attribute %s string\n", attr->name);
+	}
+}
+
+void fc_str(struct fc_str *attr, const char *val)
+{
+	struct strval *sv;
+
+	attr->val = val;
+	attr->row = out.row;
+
+	/* plain string */
+	if (!out.nominal && !out.dict) {
+		if (val)
+			fc_val("%s", val);
+		else
+			fc_val("?%s", attr->name);
+		return;
+	}
+
+	if (!val) {
+		fc_val("?");
+		return;
+	}
+
+	/* intern */
+	sv = thash_get(attr->codes, val);
+	if (!sv) {
+		sv = mmatic_zalloc(out.mm, sizeof *sv);
+		sv->code = tlist_count(attr->values);
+		sv->label = quote(val);
+		tlist_push(attr->values, sv);
+		thash_set(attr->codes, mmatic_strdup(out.mm, val), sv);
+
+		if (out.dict)
+			fprintf(out.dict, "%s,%lu,%s\n", attr->name, sv->code, sv->label);
+	}
+
+	/* WEKA sparse format: missing values are 0, or the first nominal value */
+	if (out.sparse && sv->code == 0) {
+		out.idx++;
+		return;
+	}
+
+	if (out.dict)
+		fc_val("%lu", sv->code);
+	else
+		fc_val("%s", sv->label);
+}
+
+bool fc_str_known(const char *name)
+{
+	return thash_get(out.attrs, name) != NULL;
+}
+
+const char *fc_str_get(const char *name)
+{
+	struct fc_str *attr;
+
+	attr = thash_get(out.attrs, name);
+	if (attr && attr->row == out.row)
+		return attr->val;
+	else
+		return NULL;
+}
+
+int64_t fc_ts(struct lfc_pkt *pkt)
+{
+	struct timespec ts = trace_get_timespec(pkt->ltpkt);
+
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t fc_ts_first(void)
+{
+	return out.flow->first;
+}
+
+int64_t fc_ts_last(void)
+{
+	return out.flow->last;
+}
+
+char *fc_ts_str(char *buf, int64_t ns)
+{
+	const char *sign = "";
+
+	if (ns < 0) {
+		sign = "-";
+		ns = -ns;
+	}
+
+	/* NB: microsecond timestamps look the same as ever */
+	if (ns % 1000 == 0)
+		snprintf(buf, FC_TSLEN, "%s%" PRId64 ".%06d", sign, ns / 1000000000, (int) (ns % 1000000000 / 1000));
+	else
+		snprintf(buf, FC_TSLEN, "%s%" PRId64 ".%09d", sign, ns / 1000000000, (int) (ns % 1000000000));
+
+	return buf;
+}
+
+static void flow_pkt(struct lfc *lfc, void *plugin, struct lfc_flow *lf, struct lfc_pkt *pkt, void *data)
+{
+	struct fcflow *f = data;
+
+	f->last = fc_ts(pkt);
+	if (pkt->first)
+		f->first = f->last;
 }
 
 static void flow_start(struct lfc *lfc, void *plugin, struct lfc_flow *lf, void *data)
 {
-	char src[50], dst[50];
+	char src[50], dst[50], ts[FC_TSLEN];
 
-	printf("%u", lf->id);
-	printf(",%.6f", lf->ts_first);
-	printf(",%.6f", lf->ts_last - lf->ts_first);
+	out.flow = data;
+	out.row++;
+	out.idx = 0;
+	out.cnt = 0;
+	if (out.sparse)
+		putchar('{');
+
+	fc_val("%u", lf->id);
+	fc_val("%s", fc_ts_str(ts, out.flow->first));
+	fc_val("%s", fc_ts_str(ts, out.flow->last - out.flow->first));
 
 	if (lf->proto == IPPROTO_UDP)
-		printf(",UDP");
+		fc_val("UDP");
 	else
-		printf(",TCP");
+		fc_val("TCP");
 
 	if (lf->is_ip6) {
 		inet_ntop(AF_INET6, &lf->src.addr.ip6, src, sizeof src);
@@ -205,12 +491,18 @@ static void flow_start(struct lfc *lfc, void *plugin, struct lfc_flow *lf, void
 		inet_ntop(AF_INET, &lf->dst.addr.ip4, dst, sizeof dst);
 	}
 
-	printf(",%s,%d,%s,%d", src, lf->src.port, dst, lf->dst.port);
+	fc_val("%s", src);
+	fc_val("%d", lf->src.port);
+	fc_val("%s", dst);
+	fc_val("%d", lf->dst.port);
 }
 
 static void flow_end(struct lfc *lfc, void *plugin, struct lfc_flow *lf, void *data)
 {
-	printf("\n");
+	if (out.sparse)
+		printf("}\n");
+	else
+		printf("\n");
 }
 
 int main(int argc, char *argv[])
@@ -222,6 +514,16 @@ int main(int argc, char *argv[])
 	char *name, *s;
 	tlist *ls;
 	void *pdata;
+	tlist *plugins;
+	struct plugin *pl;
+	FILE *spool = NULL;
+	int stdout_fd = -1;
+	char buf[BUFSIZ];
+	size_t len;
+	struct zout *z = NULL;
+	struct zin *zi = NULL;
+	bool payload = false;
+	int zflags;
 
 	/*
 	 * initialization
@@ -230,11 +532,24 @@ int main(int argc, char *argv[])
 	fc = mmatic_zalloc(mm, sizeof *fc);
 	fc->mm = mm;
 	fc->modules = tlist_create(NULL, mm);
+	fc->opts = thash_create_strkey(NULL, mm);
 
 	/* read options */
 	if (parse_argv(fc, argc, argv))
 		return 1;
 
+	out.mm = mm;
+	out.attrs = thash_create_strkey(NULL, mm);
+	out.sparse = fc->sparse;
+	out.nominal = fc->nominal;
+
+	if (fc->dict) {
+		out.dict = fopen(fc->dict, "w");
+		if (!out.dict)
+			die("Opening dictionary file '%s' failed: %m\n", fc->dict);
+		fprintf(out.dict, "attribute,code,value\n");
+	}
+
 	/* enable all modules found in given directory */
 	if (tlist_count(fc->modules) == 0) {
 		ls = pjf_ls(fc->dir, mm);
@@ -255,8 +570,15 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	/* compress output on worker threads */
+	if (fc->zout) {
+		z = zout_start(mm, fc->zout, fc->zthreads);
+		if (!z)
+			die("Output compression failed\n");
+	}
+
 	fc->lfc = lfc_init();
-	lfc_register(fc->lfc, "flow_start", 0, NULL, flow_start, NULL);
+	lfc_register(fc->lfc, "flow_start", sizeof(struct fcflow), flow_pkt, flow_start, NULL);
 
 	if (fc->any)      lfc_enable(fc->lfc, LFC_OPT_TCP_ANYSTART, NULL);
 	if (fc->n > 0)    lfc_enable(fc->lfc, LFC_OPT_PACKET_LIMIT, &(fc->n));
@@ -265,10 +587,9 @@ int main(int argc, char *argv[])
 	if (fc->reqclose) lfc_enable(fc->lfc, LFC_OPT_TCP_REQCLOSE, NULL);
 
 	/*
-	 * load modules and draw ARFF header
+	 * load modules
 	 */
-	if (!fc->nohead)
-		header(fc);
+	plugins = tlist_create(NULL, mm);
 
 	tlist_iter_loop(fc->modules, name) {
 		if (streq(name, "none"))
@@ -288,25 +609,76 @@ int main(int argc, char *argv[])
 				die("Opening module '%s' failed: the init() function returned false\n", name);
 		}
 
-		if (!fc->nohead && mod->header) {
-			mod->header(fc->lfc, pdata, fc);
-			printf("\n");
-		}
-
 		lfc_register(fc->lfc, name, mod->size, mod->pkt, mod->flow, pdata);
+
+		/* NB: modules that do not say what they use get everything */
+		if (mod->pkt && (!mod->uses || (mod->uses & FC_USES_PAYLOAD)))
+			payload = true;
+
+		pl = mmatic_zalloc(mm, sizeof *pl);
+		pl->name = name;
+		pl->mod = mod;
+		pl->pdata = pdata;
+		tlist_push(plugins, pl);
 	}
 
 	lfc_register(fc->lfc, "flow_end", 0, NULL, flow_end, NULL);
 
 	/*
-	 * run it!
+	 * draw ARFF header and run it!
+	 * NB: nominal values are known only at the end, so spool the rows in a temporary file
 	 */
-	if (!fc->nohead)
-		printf("@data\n");
+	if (!fc->nohead && fc->nominal) {
+		fflush(stdout);
+		spool = tmpfile();
+		stdout_fd = dup(1);
+		if (!spool || stdout_fd < 0 || dup2(fileno(spool), 1) < 0)
+			die("Creating temporary file failed: %m\n");
+	} else if (!fc->nohead) {
+		header(fc, plugins);
+	}
 
-	if (!lfc_run(fc->lfc, fc->file, fc->filter))
+	/* read (and decompress) the trace file on dedicated threads
+	 * NB: if no module needs payload (and the filter cannot look at it), pass headers only */
+	if (!fc->direct) {
+		zflags = (!payload && !fc->filter ? ZIN_TRIM : 0) |
+			(fc->decap ? ZIN_DECAP : 0) | (fc->tunnel ? ZIN_TUNNEL : 0) | (fc->csum ? ZIN_CSUM : 0);
+
+		zi = zin_start(mm, fc->file, zflags);
+		if (!zi && (fc->decap || fc->csum))
+			die("Options -I, -T and -C need a regular trace file\n");
+	}
+
+	if (!lfc_run(fc->lfc, zi ? zin_path(zi) : fc->file, fc->filter))
 		die("Reading file '%s' failed\n", fc->file);
 
+	if (zi && !zin_finish(zi))
+		die("Reading file '%s' failed\n", fc->file);
+
+	tlist_iter_loop(plugins, pl) {
+		if (pl->mod->finish)
+			pl->mod->finish(fc->lfc, pl->pdata, fc);
+	}
+
+	if (spool) {
+		fflush(stdout);
+		dup2(stdout_fd, 1);
+		close(stdout_fd);
+
+		header(fc, plugins);
+
+		rewind(spool);
+		while ((len = fread(buf, 1, sizeof buf, spool)) > 0)
+			fwrite(buf, 1, len, stdout);
+		fclose(spool);
+	}
+
+	if (out.dict)
+		fclose(out.dict);
+
+	if (z && !zout_finish(z))
+		die("Output compression failed\n");
+
 	lfc_deinit(fc->lfc);
 	mmatic_destroy(mm);
 
@@ -44,15 +44,30 @@ struct flowcalc {
 	bool any;             /**> enable LFM_CONFIG_TCP_ANYSTART? */
 	bool noloss;          /**> skip TCP flows with packet loss */
 	bool reqclose;        /**> skip TCP flows that did not close properly */
+	thash *opts;          /**> module options: name -> value */
+	bool sparse;          /**> write sparse ARFF rows? */
+	bool nominal;         /**> write string attributes as nominal? */
+	const char *dict;     /**> write codes of string attributes, dictionary to this file */
+	const char *zout;     /**> output compression: method[:level] */
+	int zthreads;         /**> number of compression threads */
+	bool direct;          /**> let libtrace read the trace file directly? */
+	bool decap;           /**> strip link headers (VLAN, MPLS, PPPoE...)? */
+	bool tunnel;          /**> take inner packets out of GRE and VXLAN? */
+	bool csum;            /**> drop IPv4 packets with bad header checksum? */
 
 	unsigned long n;      /**> packet limit */
 	double t;             /**> time limit */
 };
 
+/** What a module pkt() callback uses of packets, see struct module */
+#define FC_USES_HEADERS 0x01  /**> IP and TCP/UDP headers, sizes, timestamps */
+#define FC_USES_PAYLOAD 0x02  /**> payload bytes (pkt->data) or the libtrace packet */
+
 struct module {
 	int size;                      /**> Flow data size (bytes) */
 	pkt_cb pkt;                    /**> Per-packet callback */
 	flow_cb flow;                  /**> Flow-timeout callback */
+	int uses;                      /**> FC_USES_* flags, may be set in init() (0 = everything) */
 
 	/**> Optional initialization function
 	 * @param lfc      access to libflowcalc configuration, etc.
@@ -68,6 +83,71 @@ struct module {
 	 * @param fc       flowcalc configuration, etc.
 	 */
 	void (*header)(struct lfc *lfc, void *plugin, struct flowcalc *fc);
+
+	/**> Optional function called after the whole trace was read
+	 * @param lfc      libflowcalc configuration, etc.
+	 * @param plugin   plugin data
+	 * @param fc       flowcalc configuration, etc.
+	 */
+	void (*finish)(struct lfc *lfc, void *plugin, struct flowcalc *fc);
 };
 
+/*
+ * ARFF row output, for use in module flow() callbacks instead of printf()
+ */
+
+/** Write value of next attribute in current row
+ * @param fmt      printf() format of the value (no leading comma) */
+void fc_val(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+
+/** Skip next attributes in current row, leaving them at their default value
+ * In sparse rows, default values of "0" are not written at all.
+ * @param n        number of attributes
+ * @param def      default value, eg. "0" or "-1" */
+void fc_def(int n, const char *def);
+
+/** A string attribute: written as string, nominal (-N) or integer code (-D) */
+struct fc_str;
+
+/** Register a string attribute, in init()
+ * @param name     attribute name */
+struct fc_str *fc_str_attr(const char *name);
+
+/** Print ARFF declaration of a string attribute, in header() */
+void fc_str_header(struct fc_str *attr);
+
+/** Write value of a string attribute in current row
+ * @param val      value, or NULL if missing */
+void fc_str(struct fc_str *attr, const char *val);
+
+/** Is a string attribute registered already, eg. by a module loaded earlier?
+ * @param name     attribute name, eg. "dns_name" */
+bool fc_str_known(const char *name);
+
+/** Value of a string attribute already written in current row, eg. by another module
+ * @param name     attribute name, eg. "dns_name"
+ * @return         value, or NULL if missing or not written yet */
+const char *fc_str_get(const char *name);
+
+/*
+ * Integer timestamps [ns]: exact also for nanosecond PCAPs, unlike pkt->ts and lf->ts_first
+ */
+
+/** Timestamp of a packet, in pkt() callbacks */
+int64_t fc_ts(struct lfc_pkt *pkt);
+
+/** Timestamp of first packet in current flow, in flow() callbacks */
+int64_t fc_ts_first(void);
+
+/** Timestamp of last packet in current flow, in flow() callbacks */
+int64_t fc_ts_last(void);
+
+/** Minimum buffer size for fc_ts_str() */
+#define FC_TSLEN 32
+
+/** Format time [ns] as seconds, with 6 decimal digits (9 if needed)
+ * @param buf      at least FC_TSLEN bytes
+ * @return         buf */
+char *fc_ts_str(char *buf, int64_t ns);
+
 #endif
@@ -9,6 +9,7 @@
 #include <getopt.h>
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
 #include <stdlib.h>
 
@@ -23,6 +24,9 @@ static void cleanup()
 {
 	lfc_deinit(fd->lfc);
 	thash_free(fd->out_files);
+	free(fd->line);
+	free(fd->cols);
+	free(fd->defs);
 	mmatic_destroy(fd->mm);
 }
 
@@ -43,8 +47,10 @@ static void help(void)
 	printf("Options:\n");
 	printf("  -f \"<filter>\"          apply given packet filter on the input trace file\n");
 	printf("  -d <dir>               output directory [./flowdump]\n");
-	printf("  -c <num>               use column <num> as the output file name [1]\n");
-	printf("  -s <value>             select rows with given column <value> only\n");
+	printf("  -c <col>               use column <col> (number or name) as the output file name [1]\n");
+	printf("  -s <values>            select rows with column <col> in comma-separated <values> only\n");
+	printf("  -w \"<expr>\"            select rows matching given expression only, e.g.\n");
+	printf("                         \"crl_group in {P2P,Web} and cts_bytes_down > 1e6\"\n");
 	printf("  --verbose,-V           be verbose (alias for --debug=5)\n");
 	printf("  --debug=<num>          set debugging level\n");
 	printf("  --help,-h              show this usage help screen\n");
@@ -69,8 +75,9 @@ static void version(void)
 static int parse_argv(int argc, char *argv[])
 {
 	int i, c;
+	char *d, *s;
 
-	static char *short_opts = "hvVf:d:c:s:";
+	static char *short_opts = "hvVf:d:c:s:w:";
 	static struct option long_opts[] = {
 		/* name, has_arg, NULL, short_ch */
 		{ "verbose",    0, NULL,  1  },
@@ -83,7 +90,8 @@ static int parse_argv(int argc, char *argv[])
 	/* defaults */
 	debug = 0;
 	fd->dir = "./flowdump";
-	fd->colnum = 1;
+	fd->colname = "1";
+	fd->colnum = -1;
 
 	for (;;) {
 		c = getopt_long(argc, argv, short_opts, long_opts, &i);
@@ -99,8 +107,20 @@ static int parse_argv(int argc, char *argv[])
 			case  4 : version(); return 2;
 			case 'f': fd->filter = mmatic_strdup(fd->mm, optarg); break;
 			case 'd': fd->dir = mmatic_strdup(fd->mm, optarg); break;
-			case 'c': fd->colnum = atoi(optarg); break;
-			case 's': fd->value = mmatic_strdup(fd->mm, optarg); break;
+			case 'c': fd->colname = mmatic_strdup(fd->mm, optarg); break;
+			case 's':
+				if (!fd->values)
+					fd->values = thash_create_strkey(NULL, fd->mm);
+
+				s = mmatic_strdup(fd->mm, optarg);
+				while ((d = strchr(s, ','))) {
+					*d = 0;
+					thash_set(fd->values, s, s);
+					s = d + 1;
+				}
+				thash_set(fd->values, s, s);
+				break;
+			case 'w': fd->expr = mmatic_strdup(fd->mm, optarg); break;
 			default: help(); return 1;
 		}
 	}
@@ -118,10 +138,366 @@ static int parse_argv(int argc, char *argv[])
 
 /*******************************/
 
-static void cache_update()
+/** Copy given range of characters */
+static char *strdup_range(const char *start, const char *end)
+{
+	char *s;
+
+	s = mmatic_alloc(fd->mm, end - start + 1);
+	memcpy(s, start, end - start);
+	s[end - start] = '\0';
+
+	return s;
+}
+
+/** Skip whitespace and consume given token, if it is next */
+static bool sel_accept(const char **s, const char *tok)
+{
+	int len = strlen(tok);
+
+	while (isspace(**s)) (*s)++;
+
+	if (strncmp(*s, tok, len) != 0)
+		return false;
+
+	/* keywords must end on a word boundary */
+	if (isalpha(tok[0]) && (isalnum((*s)[len]) || (*s)[len] == '_'))
+		return false;
+
+	*s += len;
+	return true;
+}
+
+/** Read column name or value: a quoted string or a run of non-special characters */
+static char *sel_word(const char **s)
 {
-	char buf[BUFSIZ], *ptr, *cm;
+	const char *start;
+	char q;
+
+	while (isspace(**s)) (*s)++;
+
+	if (**s == '\'' || **s == '"') {
+		q = *(*s)++;
+		start = *s;
+		while (**s && **s != q) (*s)++;
+		if (!**s) return NULL;
+		return strdup_range(start, (*s)++);
+	}
+
+	start = *s;
+	while (**s && !isspace(**s) && !strchr("(){},<>=!", **s)) (*s)++;
+	if (*s == start) return NULL;
+
+	return strdup_range(start, *s);
+}
+
+static struct sel *sel_expr(const char **s);
+
+/** Parse comparison, negation or parenthesized expression */
+static struct sel *sel_cmp(const char **s)
+{
+	struct sel *sel;
+	char *v, *end;
+
+	if (sel_accept(s, "(")) {
+		sel = sel_expr(s);
+		if (!sel || !sel_accept(s, ")")) return NULL;
+		return sel;
+	}
+
+	sel = mmatic_zalloc(fd->mm, sizeof *sel);
+
+	if (sel_accept(s, "not")) {
+		sel->op = SEL_NOT;
+		sel->left = sel_cmp(s);
+		return sel->left ? sel : NULL;
+	}
+
+	sel->colname = sel_word(s);
+	if (!sel->colname) return NULL;
+
+	/* set of values? */
+	if (sel_accept(s, "in")) {
+		sel->op = SEL_IN;
+		sel->set = thash_create_strkey(NULL, fd->mm);
+
+		if (!sel_accept(s, "{")) return NULL;
+		do {
+			v = sel_word(s);
+			if (!v) return NULL;
+			thash_set(sel->set, v, v);
+		} while (sel_accept(s, ","));
+		if (!sel_accept(s, "}")) return NULL;
+
+		return sel;
+	}
+
+	if (sel_accept(s, "==") || sel_accept(s, "=")) sel->op = SEL_EQ;
+	else if (sel_accept(s, "!=")) sel->op = SEL_NE;
+	else if (sel_accept(s, "<="))  sel->op = SEL_LE;
+	else if (sel_accept(s, ">="))  sel->op = SEL_GE;
+	else if (sel_accept(s, "<"))   sel->op = SEL_LT;
+	else if (sel_accept(s, ">"))   sel->op = SEL_GT;
+	else return NULL;
+
+	sel->str = sel_word(s);
+	if (!sel->str) return NULL;
+
+	/* compare as numbers if possible */
+	sel->num = strtod(sel->str, &end);
+	sel->is_num = (end != sel->str && *end == '\0');
+
+	return sel;
+}
+
+/** Parse conjunction */
+static struct sel *sel_and(const char **s)
+{
+	struct sel *sel, *left;
+
+	left = sel_cmp(s);
+	while (left && sel_accept(s, "and")) {
+		sel = mmatic_zalloc(fd->mm, sizeof *sel);
+		sel->op = SEL_AND;
+		sel->left = left;
+		sel->right = sel_cmp(s);
+		left = sel->right ? sel : NULL;
+	}
+
+	return left;
+}
+
+/** Parse disjunction */
+static struct sel *sel_expr(const char **s)
+{
+	struct sel *sel, *left;
+
+	left = sel_and(s);
+	while (left && sel_accept(s, "or")) {
+		sel = mmatic_zalloc(fd->mm, sizeof *sel);
+		sel->op = SEL_OR;
+		sel->left = left;
+		sel->right = sel_and(s);
+		left = sel->right ? sel : NULL;
+	}
+
+	return left;
+}
+
+/** Find column index for given column number (1-based) or ARFF attribute name
+ * @retval -1    not found */
+static int col_find(const char *name)
+{
+	const char *attr;
+	char *end;
 	int i;
+
+	i = strtol(name, &end, 10);
+	if (end != name && *end == '\0')
+		return i - 1;
+
+	i = 0;
+	tlist_iter_loop(fd->attrs, attr) {
+		if (streq(attr, name))
+			return i;
+		i++;
+	}
+
+	return -1;
+}
+
+/** Resolve column names used in the selection expression */
+static void sel_resolve(struct sel *sel)
+{
+	if (!sel)
+		return;
+
+	sel_resolve(sel->left);
+	sel_resolve(sel->right);
+
+	if (!sel->colname)
+		return;
+
+	sel->col = col_find(sel->colname);
+	if (sel->col < 0) {
+		cleanup();
+		die("Column '%s' not found in the ARFF file\n", sel->colname);
+	}
+}
+
+/** Evaluate the selection expression on given ARFF row */
+static bool sel_eval(struct sel *sel, char *cols[], int ncols)
+{
+	const char *val;
+	char *end;
+	double num;
+	int cmp;
+
+	switch (sel->op) {
+		case SEL_AND: return sel_eval(sel->left, cols, ncols) && sel_eval(sel->right, cols, ncols);
+		case SEL_OR:  return sel_eval(sel->left, cols, ncols) || sel_eval(sel->right, cols, ncols);
+		case SEL_NOT: return !sel_eval(sel->left, cols, ncols);
+		default: break;
+	}
+
+	if (sel->col >= ncols)
+		return false;
+	val = cols[sel->col];
+
+	if (sel->op == SEL_IN)
+		return thash_get(sel->set, val) != NULL;
+
+	if (sel->is_num) {
+		num = strtod(val, &end);
+		if (end == val) return false; /* eg. missing value */
+		cmp = (num > sel->num) - (num < sel->num);
+	} else {
+		cmp = strcmp(val, sel->str);
+	}
+
+	switch (sel->op) {
+		case SEL_EQ: return cmp == 0;
+		case SEL_NE: return cmp != 0;
+		case SEL_LT: return cmp < 0;
+		case SEL_LE: return cmp <= 0;
+		case SEL_GT: return cmp > 0;
+		case SEL_GE: return cmp >= 0;
+		default:     return false;
+	}
+}
+
+/** Compile the row selection rules, once ARFF attribute names are known */
+static void sel_compile()
+{
+	const char *s;
+
+	fd->colnum = col_find(fd->colname);
+	if (fd->colnum < 0) {
+		cleanup();
+		die("Column '%s' not found in the ARFF file\n", fd->colname);
+	}
+
+	if (fd->expr) {
+		s = fd->expr;
+		fd->sel = sel_expr(&s);
+		while (isspace(*s)) s++;
+		if (!fd->sel || *s) {
+			cleanup();
+			die("Parsing selection expression failed near '%s'\n", s);
+		}
+
+		sel_resolve(fd->sel);
+	}
+}
+
+/*******************************/
+
+/** Remember ARFF attribute name, and its value when omitted in sparse rows */
+static void attr_add(char *line)
+{
+	const char *s = line;
+	char *name, *def = NULL;
+	int n;
+
+	name = sel_word(&s);
+	if (!name)
+		return;
+
+	/* WEKA sparse format: omitted nominal values are the first declared value, others are 0 */
+	while (isspace(*s)) s++;
+	if (*s == '{') {
+		s++;
+		def = sel_word(&s);
+	}
+
+	tlist_push(fd->attrs, name);
+
+	n = tlist_count(fd->attrs);
+	fd->defs = realloc(fd->defs, n * sizeof(char *));
+	if (!fd->defs)
+		die("Out of memory\n");
+	fd->defs[n - 1] = def ? def : "0";
+}
+
+/** Split ARFF data row into columns, in place
+ * @return number of columns */
+static int row_split(char *buf, char *cols[], int max)
+{
+	char *ptr = buf, q;
+	int n = 0;
+
+	while (n < max) {
+		if (*ptr == '\'' || *ptr == '"') {
+			/* quoted string */
+			q = *ptr++;
+			cols[n++] = ptr;
+			for (; *ptr && *ptr != q; ptr++) {
+				if (*ptr == '\\' && ptr[1]) ptr++;
+			}
+			if (*ptr) *ptr++ = '\0';
+		} else {
+			cols[n++] = ptr;
+		}
+
+		ptr += strcspn(ptr, ",\r\n");
+		if (*ptr != ',') {
+			*ptr = '\0';
+			break;
+		}
+		*ptr++ = '\0';
+	}
+
+	return n;
+}
+
+/** Split sparse ARFF data row into columns, in place: omitted columns get their defaults
+ * @return number of columns */
+static int row_sparse(char *buf, char *cols[], int max)
+{
+	char *ptr = buf + 1, *end, q;
+	int n, i, idx;
+
+	n = MIN(tlist_count(fd->attrs), max);
+	for (i = 0; i < n; i++)
+		cols[i] = fd->defs[i];
+
+	for (;;) {
+		idx = strtol(ptr, &end, 10);
+		if (end == ptr || *end != ' ')
+			break;
+		ptr = end + 1;
+
+		if (idx < 0 || idx >= n)
+			idx = -1;
+
+		if (*ptr == '\'' || *ptr == '"') {
+			/* quoted string */
+			q = *ptr++;
+			if (idx >= 0) cols[idx] = ptr;
+			for (; *ptr && *ptr != q; ptr++) {
+				if (*ptr == '\\' && ptr[1]) ptr++;
+			}
+			if (*ptr) *ptr++ = '\0';
+		} else if (idx >= 0) {
+			cols[idx] = ptr;
+		}
+
+		ptr += strcspn(ptr, ",}\r\n");
+		if (*ptr != ',') {
+			*ptr = '\0';
+			break;
+		}
+		*ptr++ = '\0';
+	}
+
+	return n;
+}
+
+static void cache_update()
+{
+	char *buf, **cols, *name;
+	ssize_t len;
+	int i, n, need;
 	unsigned int id;
 
 	if (!fd->afh)
@@ -130,39 +506,58 @@ static void cache_update()
 	if (thash_count(fd->cache) > 50000000)
 		return;
 
-	while (thash_count(fd->cache) < 10000000 && fgets(buf, sizeof buf, fd->afh)) {
-		if (!isdigit(buf[0]))
+	while (thash_count(fd->cache) < 10000000 &&
+	       (len = getline(&fd->line, &fd->linesize, fd->afh)) >= 0) {
+		buf = fd->line;
+
+		if (strncasecmp(buf, "@attribute", 10) == 0) {
+			attr_add(buf + 10);
 			continue;
+		}
 
-		ptr = buf;
-		cm = strchr(ptr, ',');
-		if (!cm)
+		if (!isdigit(buf[0]) && buf[0] != '{')
 			continue;
+
+		/* first row: all ARFF attributes are known now */
+		if (fd->colnum < 0)
+			sel_compile();
+
+		/* NB: a row has at most len + 1 columns, or one for each attribute if sparse */
+		need = MAX(len + 1, tlist_count(fd->attrs));
+		if (need > fd->colsize) {
+			fd->colsize = need;
+			fd->cols = realloc(fd->cols, need * sizeof(char *));
+			if (!fd->cols)
+				die("Out of memory\n");
+		}
+		cols = fd->cols;
+
+		if (buf[0] == '{')
+			n = row_sparse(buf, cols, need);
 		else
-			*cm = '\0';
+			n = row_split(buf, cols, need);
+		if (n <= fd->colnum)
+			continue;
 
 		/* get flow id */
-		id = atoi(ptr);
-
-		/* get flow target */
-		for (i = 1; i < fd->colnum; i++) {
-			ptr = cm + 1;
-			cm = strchr(ptr, ',');
-			if (!cm) {
-				cm = strchr(ptr, '\n');
-				break;
-			}
-		}
+		id = atoi(cols[0]);
+
+		/* evaluate the row selection expression */
+		if (fd->sel && !sel_eval(fd->sel, cols, n))
+			continue;
 
-		if (cm)
-			*cm = '\0';
+		/* ignore flows with column values we are not interested in (raw values, as in -w) */
+		if (fd->values && !thash_get(fd->values, cols[fd->colnum]))
+			continue;
 
-		for (i = 0; ptr[i]; i++) {
-			if (!isalnum(ptr[i]))
-				ptr[i] = '_';
+		/* get flow target: value as file name */
+		name = mmatic_strdup(fd->mm, cols[fd->colnum]);
+		for (i = 0; name[i]; i++) {
+			if (!isalnum(name[i]))
+				name[i] = '_';
 		}
 
-		thash_uint_set(fd->cache, id, mmatic_strdup(fd->mm, ptr));
+		thash_uint_set(fd->cache, id, name);
 	}
 
 	if (feof(fd->afh)) {
@@ -195,13 +590,6 @@ static void pkt(struct lfc *lfc, void *pdata,
 			}
 		}
 
-		/* ignore flows with column values we are not interested in */
-		if (fd->value && !streq(fd->value, name)) {
-			f->ignore = true;
-			thash_uint_set(fd->cache, lf->id, NULL);
-			return;
-		}
-
 		/* get libtrace output file */
 		out = thash_get(fd->out_files, name);
 		if (!out) {
@@ -254,6 +642,7 @@ int main(int argc, char *argv[])
 	mm = mmatic_create();
 	fd = mmatic_zalloc(mm, sizeof *fd);
 	fd->mm = mm;
+	fd->attrs = tlist_create(NULL, mm);
 	fd->cache = thash_create_intkey(mmatic_free, mm);
 	fd->out_files = thash_create_strkey(trace_destroy_output, mm);
 
@@ -18,15 +18,43 @@ struct flow {
 	bool ignore;            /**> if true, skip this flow */
 };
 
+/** Row selection expression node */
+struct sel {
+	enum sel_op {
+		SEL_AND = 1, SEL_OR, SEL_NOT,
+		SEL_IN, SEL_EQ, SEL_NE,
+		SEL_LT, SEL_LE, SEL_GT, SEL_GE
+	} op;
+
+	struct sel *left;       /**> SEL_AND, SEL_OR, SEL_NOT: 1st argument */
+	struct sel *right;      /**> SEL_AND, SEL_OR: 2nd argument */
+
+	const char *colname;    /**> column name or number, as given by user */
+	int col;                /**> column index (0-based) */
+	const char *str;        /**> value to compare with */
+	double num;             /**> str as number */
+	bool is_num;            /**> compare numbers instead of strings? */
+	thash *set;             /**> SEL_IN: set of values: (char *) value -> true */
+};
+
 struct flowdump {
 	mmatic *mm;             /**> memory */
 	struct lfc *lfc;        /**> libflowcalc handle */
 
 	const char *arff_file;  /**> ARFF file */
 	FILE *afh;              /**> arff_file fopen() */
-	uint16_t colnum;        /**> column number */
-	const char *value;      /**> value to search for */
+	const char *colname;    /**> column name or number: output file name */
+	int colnum;             /**> colname index (0-based) */
+	tlist *attrs;           /**> list of char*: ARFF attribute names */
+	char **defs;            /**> value of each attribute when omitted in sparse rows */
+	thash *values;          /**> set of values to select: (char *) value -> true */
+	const char *expr;       /**> row selection expression */
+	struct sel *sel;        /**> expr compiled, NULL if not yet */
 	thash *cache;           /**> cache: flow id -> name */
+	char *line;             /**> current ARFF line, see getline() */
+	size_t linesize;        /**> size of line buffer */
+	char **cols;            /**> columns of current ARFF row */
+	int colsize;            /**> size of cols */
 
 	const char *pcap_file;  /**> trace file */
 	const char *filter;     /**> optional filter */
@@ -1,32 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
 #include "flowcalc.h"
 #include "lpi/libprotoident.h"
 
-bool init()
+/** A hand-made correction of libprotoident result, see fixes[] */
+struct fix {
+	const char *category;          /**> match category (NULL: any) */
+	const char *proto;             /**> match protocol */
+	uint16_t port;                 /**> match destination port (0: any) */
+	const char *dns;               /**> match DNS name suffix (NULL: any) */
+	uint16_t notport;              /**> do not match if any port equals this (0: none) */
+
+	const char *to_category;       /**> new category */
+	const char *to_proto;          /**> new protocol */
+};
+
+/** Corrections applied with -o lpi_fix=1, in order: first match wins */
+static struct fix fixes[] = {
+	{ "P2P", "HTTP_NonStandard", 6969, NULL, 0, "P2P", "BitTorrent" },
+	{ "P2P", "HTTP_NonStandard", 2710, NULL, 0, "P2P", "BitTorrent" },
+	{ "P2P", "HTTP_NonStandard", 3310, NULL, 0, "P2P", "BitTorrent" },
+
+	{ NULL, "No_Payload", 6969, NULL, 0, "P2P", "BitTorrent" },
+	{ NULL, "No_Payload", 6881, NULL, 0, "P2P", "BitTorrent" },
+	{ NULL, "No_Payload", 2710, NULL, 0, "P2P", "BitTorrent" },
+	{ NULL, "No_Payload",   80, NULL, 0, "Web", "HTTP" },
+	{ NULL, "No_Payload",  443, NULL, 0, "Web", "HTTPS" },
+	{ NULL, "No_Payload", 5222, NULL, 0, "Conferencing", "XMPP" },
+	{ NULL, "No_Payload",  110, NULL, 0, "Mail", "POP3" },
+	{ NULL, "No_Payload",    0, "teamviewer.com", 0, "Remote_Access", "Teamviewer" },
+
+	{ "Tunnelling", "Teredo", 0, NULL, 3544, "Unknown", "Unknown" },
+};
+
+static struct fc_str *attr_category, *attr_proto;
+
+/** fixes[] indexed by "protocol" and "protocol:port" -> tlist of struct fix */
+static thash *fixidx;
+
+/** Give libprotoident every packet, not only until the first payloads (-o lpi_full=1) */
+static bool full;
+
+/** Is name equal to suffix or its subdomain? */
+static bool dns_match(const char *name, const char *suffix)
+{
+	int nlen, slen;
+
+	if (!name)
+		return false;
+
+	nlen = strlen(name);
+	slen = strlen(suffix);
+	if (nlen < slen || strcmp(name + nlen - slen, suffix) != 0)
+		return false;
+
+	return (nlen == slen || name[nlen - slen - 1] == '.');
+}
+
+/** Find correction in one index entry */
+static struct fix *fix_find(const char *key, const char *category, struct lfc_flow *lf)
+{
+	tlist *l;
+	struct fix *f;
+
+	l = thash_get(fixidx, key);
+	if (!l)
+		return NULL;
+
+	tlist_iter_loop(l, f) {
+		if (f->category && !streq(f->category, category))
+			continue;
+		if (f->notport && (lf->src.port == f->notport || lf->dst.port == f->notport))
+			continue;
+		if (f->dns && !dns_match(fc_str_get("dns_name"), f->dns))
+			continue;
+
+		return f;
+	}
+
+	return NULL;
+}
+
+static void fix_init(mmatic *mm)
+{
+	struct fix *f;
+	const char *key;
+	tlist *l;
+	int i;
+
+	fixidx = thash_create_strkey(NULL, mm);
+
+	for (i = 0; i < N(fixes); i++) {
+		f = &fixes[i];
+
+		if (f->port)
+			key = mmatic_sprintf(mm, "%s:%u", f->proto, f->port);
+		else
+			key = f->proto;
+
+		l = thash_get(fixidx, key);
+		if (!l) {
+			l = tlist_create(NULL, mm);
+			thash_set(fixidx, key, l);
+		}
+
+		tlist_push(l, f);
+	}
+}
+
+bool init(struct lfc *lfc, void **pdata, struct flowcalc *fc)
 {
+	const char *opt;
+
+	attr_category = fc_str_attr("lpi_category");
+	attr_proto = fc_str_attr("lpi_proto");
+
+	opt = thash_get(fc->opts, "lpi_fix");
+	if (opt && atoi(opt) > 0) {
+		fix_init(fc->mm);
+
+		/* NB: the DNS name rules read dns_name of the current row, so dns needs to run first */
+		if (!fc_str_known("dns_name"))
+			dbg(0, "lpi: warning: dns module not enabled before lpi (eg. -e dns,lpi), "
+				"lpi_fix rules for DNS names will not match\n");
+	}
+
+	opt = thash_get(fc->opts, "lpi_full");
+	full = (opt && atoi(opt) > 0);
+
 	return (lpi_init_library() == 0);
 }
 
 void header()
 {
 	printf("%%%% lpi 0.1 - libprotoident\n");
-	printf("@attribute lpi_category string\n");
-	printf("@attribute lpi_proto string\n");
+	if (fixidx)
+		printf("%%%% lpi_fix: %d corrections of libprotoident results\n", (int) N(fixes));
+	fc_str_header(attr_category);
+	fc_str_header(attr_proto);
 }
 
 void pkt(struct lfc *lfc, void *pdata,
 	struct lfc_flow *lf, struct lfc_pkt *pkt, void *data)
 {
-	if (pkt->first) lpi_init_data(data);
-	lpi_update_data(pkt->ltpkt, data, pkt->up);
+	lpi_data_t *ld = data;
+
+	if (pkt->first) lpi_init_data(ld);
+
+	/* NB: once libprotoident has the first payload in both directions, it only counts payload
+	 *     bytes: do it here instead of passing the whole packet, see tools/lpicheck */
+	if (!full && ld->payload_len[0] > 0 && ld->payload_len[1] > 0)
+		ld->observed[pkt->up] += trace_get_payload_length(pkt->ltpkt);
+	else
+		lpi_update_data(pkt->ltpkt, ld, pkt->up);
 }
 
 void flow(struct lfc *lfc, void *pdata,
 	struct lfc_flow *lf, void *data)
 {
 	lpi_module_t *lm;
+	const char *category, *proto;
+	char key[64];
+	struct fix *f = NULL;
 
 	lm = lpi_guess_protocol(data);
-	printf(",%s,%s", lpi_print_category(lm->category), lm->name);
+	category = lpi_print_category(lm->category);
+	proto = lm->name;
+
+	if (fixidx) {
+		snprintf(key, sizeof key, "%s:%u", proto, lf->dst.port);
+		f = fix_find(key, category, lf);
+		if (!f)
+			f = fix_find(proto, category, lf);
+	}
+
+	if (f) {
+		category = f->to_category;
+		proto = f->to_proto;
+	}
+
+	fc_str(attr_category, category);
+	fc_str(attr_proto, proto);
 
 	return;
 }
@@ -36,5 +192,6 @@ struct module module = {
 	.init = init,
 	.header = header,
 	.pkt = pkt,
+	.uses = FC_USES_PAYLOAD,
 	.flow = flow
 };
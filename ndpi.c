@@ -0,0 +1,285 @@
+/*
+ * ndpi - nDPI traffic classifier for flowcalc (nDPI 3.x API)
+ *
+ * Options (see flowcalc -o):
+ *   ndpi_hosts=<N>        size of the per-host state table [65536]
+ *   ndpi_maxpkts=<N>      give up detection after N packets in flow [64]
+ *
+ * The nDPI flow state is taken from a pool when the flow starts and given back as soon as detection
+ * is finished, so only flows still being detected hold one. Per-host state lives in a fixed-size
+ * table indexed by address hash: on collision, the slot is reset for the new host.
+ *
+ * Rewritten from the 2012 nDPI / OpenDPI module by Paweł Foremski <pjf@iitis.pl>
+ * Copyright (C) 2012, 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Licensed under GNU GPL v. 3
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ndpi/ndpi_api.h>
+#include "flowcalc.h"
+
+/** Max. number of free flow structs kept in pool */
+#define NDPI_POOL_MAX 4096
+
+struct host {
+	uint32_t addr[4];                /**> IPv4 or IPv6 address */
+	bool used;                       /**> slot taken? */
+};
+
+struct ndpi {
+	struct ndpi_detection_module_struct *ndpi;
+
+	struct host *hosts;              /**> per-host state: addresses */
+	char *ids;                       /**> per-host state: struct ndpi_id_struct[mask + 1] */
+	uint32_t mask;                   /**> table size - 1 */
+	uint32_t idsize;                 /**> size of struct ndpi_id_struct */
+	int maxpkts;                     /**> give up after this many packets */
+};
+
+struct flow {
+	struct ndpi_flow_struct *nf;     /**> nDPI flow state, NULL if not started or done */
+	ndpi_protocol proto;             /**> detection result */
+	uint16_t pkts;                   /**> number of packets given to nDPI */
+	bool done;                       /**> detection finished? */
+};
+
+static struct fc_str *attr_category, *attr_proto;
+
+/*****/
+
+/** Pool of free flow structs, linked through their first bytes */
+static struct {
+	void *head;                      /**> first free struct */
+	int count;                       /**> number of free structs */
+	uint32_t size;                   /**> size of struct ndpi_flow_struct */
+	void *releasing;                 /**> struct being released, see nd_free() */
+} pool;
+
+static struct ndpi_flow_struct *pool_get(void)
+{
+	void *nf = pool.head;
+
+	if (nf) {
+		pool.head = *((void **) nf);
+		pool.count--;
+	} else {
+		nf = malloc(pool.size);
+		if (!nf)
+			die("Out of memory\n");
+	}
+
+	memset(nf, 0, pool.size);
+	return nf;
+}
+
+static void pool_put(void *nf)
+{
+	if (pool.count >= NDPI_POOL_MAX) {
+		free(nf);
+		return;
+	}
+
+	*((void **) nf) = pool.head;
+	pool.head = nf;
+	pool.count++;
+}
+
+/** free() for nDPI: takes the flow struct back to the pool, see flow_release() */
+static void nd_free(void *ptr)
+{
+	if (ptr && ptr == pool.releasing)
+		pool_put(ptr);
+	else
+		free(ptr);
+}
+
+/** Free what nDPI allocated for the flow, keep the struct in pool */
+static void flow_release(struct flow *f)
+{
+	pool.releasing = f->nf;
+	ndpi_free_flow(f->nf);
+	pool.releasing = NULL;
+
+	f->nf = NULL;
+}
+
+/** Finish detection, guessing the protocol if needed */
+static void flow_done(struct ndpi *nd, struct flow *f)
+{
+	uint8_t guessed;
+
+	if (f->proto.app_protocol == NDPI_PROTOCOL_UNKNOWN)
+		f->proto = ndpi_detection_giveup(nd->ndpi, f->nf, 1, &guessed);
+
+	flow_release(f);
+	f->done = true;
+}
+
+/*****/
+
+static struct ndpi_id_struct *getid(struct ndpi *nd, struct lfc_flow *lf, struct lfc_flow_addr *lfa)
+{
+	uint32_t addr[4] = { 0 }, h;
+	struct host *host;
+	char *id;
+
+	if (lf->is_ip6)
+		memcpy(addr, &lfa->addr.ip6, sizeof addr);
+	else
+		addr[0] = lfa->addr.ip4.s_addr;
+
+	h = (addr[0] ^ addr[1] * 0x9e3779b1U ^ addr[2] * 0x85ebca6bU ^ addr[3] * 0xc2b2ae35U);
+	h = (h ^ (h >> 16)) * 0x45d9f3bU;
+	h = (h ^ (h >> 16)) & nd->mask;
+
+	host = &nd->hosts[h];
+	id = nd->ids + (size_t) h * nd->idsize;
+
+	/* NB: on collision, the old host loses its state */
+	if (!host->used || memcmp(host->addr, addr, sizeof addr) != 0) {
+		memcpy(host->addr, addr, sizeof addr);
+		host->used = true;
+		memset(id, 0, nd->idsize);
+	}
+
+	return (struct ndpi_id_struct *) id;
+}
+
+/*****/
+
+bool init(struct lfc *lfc, void **pdata, struct flowcalc *fc)
+{
+	struct ndpi *nd;
+	const char *opt;
+	uint32_t hosts;
+	NDPI_PROTOCOL_BITMASK all;
+
+	nd = mmatic_zalloc(lfc->mm, sizeof *nd);
+
+	opt = thash_get(fc->opts, "ndpi_hosts");
+	hosts = opt ? strtoul(opt, NULL, 10) : 65536;
+	if (hosts < 1 || hosts > (1U << 24)) {
+		dbg(0, "ndpi: ndpi_hosts must be in range 1-%u\n", 1U << 24);
+		return false;
+	}
+	for (nd->mask = 1; nd->mask < hosts; nd->mask *= 2);
+	nd->mask--;
+
+	opt = thash_get(fc->opts, "ndpi_maxpkts");
+	nd->maxpkts = opt ? atoi(opt) : 64;
+	if (nd->maxpkts < 1 || nd->maxpkts > UINT16_MAX) {
+		dbg(0, "ndpi: ndpi_maxpkts must be in range 1-%d\n", UINT16_MAX);
+		return false;
+	}
+
+	set_ndpi_free(nd_free);
+	set_ndpi_flow_free(nd_free);
+	nd->ndpi = ndpi_init_detection_module(ndpi_no_prefs);
+	if (!nd->ndpi) {
+		dbg(0, "ndpi: ndpi_init_detection_module() failed\n");
+		return false;
+	}
+
+	NDPI_BITMASK_SET_ALL(all);
+	ndpi_set_protocol_detection_bitmask2(nd->ndpi, &all);
+	ndpi_finalize_initialization(nd->ndpi);
+
+	pool.size = ndpi_detection_get_sizeof_ndpi_flow_struct();
+	nd->idsize = ndpi_detection_get_sizeof_ndpi_id_struct();
+	nd->hosts = mmatic_zalloc(lfc->mm, (nd->mask + 1) * sizeof(struct host));
+	nd->ids = mmatic_zalloc(lfc->mm, (size_t) (nd->mask + 1) * nd->idsize);
+
+	attr_category = fc_str_attr("ndpi_category");
+	attr_proto = fc_str_attr("ndpi_proto");
+
+	*pdata = nd;
+	return true;
+}
+
+void header()
+{
+	printf("%%%% ndpi 0.2 - nDPI\n");
+	fc_str_header(attr_category);
+	fc_str_header(attr_proto);
+}
+
+void pkt(struct lfc *lfc, void *pdata,
+	struct lfc_flow *lf, struct lfc_pkt *pkt, void *data)
+{
+	struct ndpi *nd = pdata;
+	struct flow *f = data;
+	struct ndpi_id_struct *srcid, *dstid;
+	uint8_t *iph;
+	uint16_t et;
+	uint32_t rem;
+
+	if (f->done) return;
+
+	iph = trace_get_layer3(pkt->ltpkt, &et, &rem);
+	if (!iph || rem == 0) return;
+
+	if (!f->nf)
+		f->nf = pool_get();
+
+	if (pkt->up) {
+		srcid = getid(nd, lf, &lf->src);
+		dstid = getid(nd, lf, &lf->dst);
+	} else {
+		srcid = getid(nd, lf, &lf->dst);
+		dstid = getid(nd, lf, &lf->src);
+	}
+
+	f->proto = ndpi_detection_process_packet(nd->ndpi, f->nf, iph, MIN(rem, UINT16_MAX),
+		fc_ts(pkt) / 1000000, srcid, dstid);
+
+	/* stop once nDPI is done with the flow */
+	if (++f->pkts >= nd->maxpkts ||
+	    (f->proto.app_protocol != NDPI_PROTOCOL_UNKNOWN &&
+	     !ndpi_extra_dissection_possible(nd->ndpi, f->nf)))
+		flow_done(nd, f);
+}
+
+void flow(struct lfc *lfc, void *pdata,
+	struct lfc_flow *lf, void *data)
+{
+	struct ndpi *nd = pdata;
+	struct flow *f = data;
+	char buf[64];
+
+	if (f->nf)
+		flow_done(nd, f);
+
+	if (!f->done) {
+		fc_str(attr_category, NULL);
+		fc_str(attr_proto, NULL);
+		return;
+	}
+
+	fc_str(attr_category, ndpi_category_get_name(nd->ndpi, f->proto.category));
+	fc_str(attr_proto, ndpi_protocol2name(nd->ndpi, f->proto, buf, sizeof buf));
+}
+
+void finish(struct lfc *lfc, void *pdata, struct flowcalc *fc)
+{
+	struct ndpi *nd = pdata;
+	void *nf;
+
+	ndpi_exit_detection_module(nd->ndpi);
+
+	while ((nf = pool.head)) {
+		pool.head = *((void **) nf);
+		free(nf);
+	}
+	pool.count = 0;
+}
+
+struct module module = {
+	.size = sizeof(struct flow),
+	.init = init,
+	.header = header,
+	.pkt  = pkt,
+	.uses = FC_USES_PAYLOAD,
+	.flow = flow,
+	.finish = finish
+};
@@ -0,0 +1,278 @@
+/*
+ * npy - write first packets of each flow as fixed-shape NumPy arrays
+ *
+ * For F flows, writes the following little-endian .npy files, ready for numpy.load(mmap_mode='r'):
+ *   <out>.size.npy     uint16 (F, N)     payload sizes of first N packets
+ *   <out>.iat.npy      uint32 (F, N)     inter-arrival times to previous packet [us]
+ *   <out>.dir.npy      int8   (F, N)     packet direction: 1 = up, -1 = down, 0 = no packet
+ *   <out>.payload.npy  uint8  (F, 2, K)  first K payload bytes: [:, 0] up, [:, 1] down
+ *   <out>.meta.csv                       flow metadata, one line per array row
+ * The ARFF output gets the npy_row attribute: the row index in the arrays.
+ * Nothing is written unless npy_out is given, so the module can stay in the module directory.
+ *
+ * Options (see flowcalc -o):
+ *   npy_out=<prefix>   output file prefix, enables the module
+ *   npy_n=<N>          number of packets [32]
+ *   npy_k=<K>          number of payload bytes per direction [64]
+ *   npy_empty=1        record packets without payload too
+ *
+ * Copyright (c) 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Licensed under GNU GPL v. 3
+ */
+
+#include <endian.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <libpjf/lib.h>
+#include "flowcalc.h"
+
+/* size of .npy header, incl. magic: multiple of 64 */
+#define NPY_HDRLEN 128
+
+/* max. N and K */
+#define NPY_MAX 10000
+
+struct conf {
+	const char *out;           /**> output file prefix, NULL = module disabled */
+	int n;                     /**> number of packets */
+	int k;                     /**> number of payload bytes per direction */
+	bool empty;                /**> record packets without payload? */
+
+	FILE *size;                /**> <out>.size.npy */
+	FILE *iat;                 /**> <out>.iat.npy */
+	FILE *dir;                 /**> <out>.dir.npy */
+	FILE *payload;             /**> <out>.payload.npy */
+	FILE *meta;                /**> <out>.meta.csv */
+	uint32_t rows;             /**> number of flows written */
+
+	int off_iat;               /**> offset of uint32_t iat[n] in flow data */
+	int off_dir;               /**> offset of int8_t dir[n] in flow data */
+	int off_payload;           /**> offset of uint8_t payload[2][k] in flow data */
+};
+
+/* Per-flow data block: struct flow, uint16_t size[n], then the other arrays, see struct conf */
+struct flow {
+	uint32_t cnt;              /**> number of packets recorded */
+	uint32_t plen[2];          /**> payload bytes recorded (down, up) */
+	int64_t last_ts;           /**> timestamp of last packet recorded [ns] */
+};
+
+/* defined at the end, init() updates the flow data size and what it uses */
+extern struct module module;
+
+/*****************************/
+
+/** Write (or re-write) .npy header
+ * @param descr   numpy dtype, e.g. "<u2"
+ * @param shape   shape after the number of rows, e.g. "32," */
+static void npy_header(FILE *fp, const char *descr, uint32_t rows, const char *shape)
+{
+	char hdr[NPY_HDRLEN];
+	int len;
+
+	memset(hdr, ' ', sizeof hdr);
+	memcpy(hdr, "\x93NUMPY\x01\x00", 8);
+	hdr[8] = (NPY_HDRLEN - 10) & 0xff;
+	hdr[9] = (NPY_HDRLEN - 10) >> 8;
+
+	len = snprintf(hdr + 10, NPY_HDRLEN - 10, "{'descr': '%s', 'fortran_order': False, 'shape': (%u, %s), }",
+		descr, rows, shape);
+	hdr[10 + len] = ' ';
+	hdr[NPY_HDRLEN - 1] = '\n';
+
+	rewind(fp);
+	fwrite(hdr, sizeof hdr, 1, fp);
+}
+
+static FILE *npy_open(struct lfc *lfc, struct conf *conf, const char *name)
+{
+	char *path;
+	FILE *fp;
+
+	path = mmatic_sprintf(lfc->mm, "%s.%s", conf->out, name);
+	fp = fopen(path, "w");
+	if (!fp)
+		dbg(0, "npy: could not open %s: %m\n", path);
+
+	mmatic_free(path);
+	return fp;
+}
+
+/** Write all .npy headers for current number of rows */
+static void npy_headers(struct conf *conf)
+{
+	char shape[32];
+
+	snprintf(shape, sizeof shape, "%d", conf->n);
+	npy_header(conf->size, "<u2", conf->rows, shape);
+	npy_header(conf->iat, "<u4", conf->rows, shape);
+	npy_header(conf->dir, "|i1", conf->rows, shape);
+
+	snprintf(shape, sizeof shape, "2, %d", conf->k);
+	npy_header(conf->payload, "|u1", conf->rows, shape);
+}
+
+bool init(struct lfc *lfc, void **pdata, struct flowcalc *fc)
+{
+	struct conf *conf;
+	const char *opt;
+	int size;
+
+	conf = mmatic_zalloc(lfc->mm, sizeof *conf);
+	*pdata = conf;
+
+	/* no output prefix: stay out of the way, do not write anything */
+	conf->out = thash_get(fc->opts, "npy_out");
+	if (!conf->out) {
+		dbg(1, "npy: no npy_out option given, module disabled\n");
+		module.pkt = NULL;
+		return true;
+	}
+
+	opt = thash_get(fc->opts, "npy_n");
+	conf->n = opt ? atoi(opt) : 32;
+
+	opt = thash_get(fc->opts, "npy_k");
+	conf->k = opt ? atoi(opt) : 64;
+
+	if (conf->n < 1 || conf->n > NPY_MAX || conf->k < 0 || conf->k > NPY_MAX) {
+		dbg(0, "npy: npy_n and npy_k must be in range 1-%d\n", NPY_MAX);
+		return false;
+	}
+
+	opt = thash_get(fc->opts, "npy_empty");
+	conf->empty = opt && !streq(opt, "0");
+
+	/* open files, write headers with 0 rows for now */
+	conf->size = npy_open(lfc, conf, "size.npy");
+	conf->iat = npy_open(lfc, conf, "iat.npy");
+	conf->dir = npy_open(lfc, conf, "dir.npy");
+	conf->payload = npy_open(lfc, conf, "payload.npy");
+	conf->meta = npy_open(lfc, conf, "meta.csv");
+	if (!conf->size || !conf->iat || !conf->dir || !conf->payload || !conf->meta)
+		return false;
+
+	npy_headers(conf);
+	fprintf(conf->meta, "row,id,tstamp,duration,proto,src_addr,src_port,dst_addr,dst_port,pkts\n");
+
+	/* lay out the flow data block */
+	size = sizeof(struct flow) + conf->n * sizeof(uint16_t);
+	size = (size + 3) & ~3;
+	conf->off_iat = size;
+	size += conf->n * sizeof(uint32_t);
+	conf->off_dir = size;
+	size += conf->n;
+	conf->off_payload = size;
+	size += 2 * conf->k;
+	module.size = size;
+	if (conf->k > 0)
+		module.uses |= FC_USES_PAYLOAD;
+
+	return true;
+}
+
+void header(struct lfc *lfc, void *pdata, struct flowcalc *fc)
+{
+	struct conf *conf = pdata;
+
+	if (!conf->out) return;
+
+	printf("%%%% npy 0.1\n");
+	printf("%% npy_row: row index in the .npy files\n");
+	printf("@attribute npy_row numeric\n");
+}
+
+void pkt(struct lfc *lfc, void *pdata,
+	struct lfc_flow *lf, struct lfc_pkt *pkt, void *data)
+{
+	struct conf *conf = pdata;
+	struct flow *f = data;
+	uint8_t *block = data;
+	uint32_t n, i;
+	int64_t ts, iat;
+
+	if (pkt->dup) return;
+	if (pkt->psize == 0 && !conf->empty) return;
+
+	/* payload bytes: until K bytes in this direction */
+	if (f->plen[pkt->up] < conf->k && pkt->data && pkt->len > 0) {
+		n = MIN(pkt->len, conf->k - f->plen[pkt->up]);
+		memcpy(block + conf->off_payload + (pkt->up ? 0 : conf->k) + f->plen[pkt->up], pkt->data, n);
+		f->plen[pkt->up] += n;
+	}
+
+	/* packet sequence: until N packets */
+	if (f->cnt == conf->n) return;
+	i = f->cnt++;
+
+	((uint16_t *) (f + 1))[i] = htole16(MIN(pkt->psize, UINT16_MAX));
+
+	ts = fc_ts(pkt);
+	iat = (f->last_ts > 0 && ts > f->last_ts) ? (ts - f->last_ts + 500) / 1000 : 0;
+	((uint32_t *) (block + conf->off_iat))[i] = htole32(MIN(iat, UINT32_MAX));
+	f->last_ts = ts;
+
+	((int8_t *) (block + conf->off_dir))[i] = pkt->up ? 1 : -1;
+}
+
+void flow(struct lfc *lfc, void *pdata,
+	struct lfc_flow *lf, void *data)
+{
+	struct conf *conf = pdata;
+	struct flow *f = data;
+	uint8_t *block = data;
+	char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+	char first[FC_TSLEN], dur[FC_TSLEN];
+
+	if (!conf->out) return;
+
+	/* array rows: unused packet slots and payload bytes are zero */
+	fwrite(f + 1, sizeof(uint16_t), conf->n, conf->size);
+	fwrite(block + conf->off_iat, sizeof(uint32_t), conf->n, conf->iat);
+	fwrite(block + conf->off_dir, 1, conf->n, conf->dir);
+	fwrite(block + conf->off_payload, 1, 2 * conf->k, conf->payload);
+
+	/* metadata */
+	if (lf->is_ip6) {
+		inet_ntop(AF_INET6, &lf->src.addr.ip6, src, sizeof src);
+		inet_ntop(AF_INET6, &lf->dst.addr.ip6, dst, sizeof dst);
+	} else {
+		inet_ntop(AF_INET, &lf->src.addr.ip4, src, sizeof src);
+		inet_ntop(AF_INET, &lf->dst.addr.ip4, dst, sizeof dst);
+	}
+
+	fprintf(conf->meta, "%u,%u,%s,%s,%s,%s,%u,%s,%u,%u\n",
+		conf->rows, lf->id,
+		fc_ts_str(first, fc_ts_first()), fc_ts_str(dur, fc_ts_last() - fc_ts_first()),
+		lf->proto == IPPROTO_UDP ? "UDP" : "TCP",
+		src, lf->src.port, dst, lf->dst.port, f->cnt);
+
+	fc_val("%u", conf->rows++);
+}
+
+void finish(struct lfc *lfc, void *pdata, struct flowcalc *fc)
+{
+	struct conf *conf = pdata;
+
+	if (!conf->out) return;
+
+	/* final number of rows */
+	npy_headers(conf);
+
+	fclose(conf->size);
+	fclose(conf->iat);
+	fclose(conf->dir);
+	fclose(conf->payload);
+	fclose(conf->meta);
+}
+
+struct module module = {
+	.size = sizeof(struct flow),
+	.init = init,
+	.header = header,
+	.pkt  = pkt,
+	.uses = FC_USES_HEADERS,
+	.flow = flow,
+	.finish = finish
+};
@@ -54,20 +54,22 @@ void pkt(struct lfc *lfc, void *mydata,
 
 static void print_buf(char *v, int s)
 {
-	int i;
+	char buf[2 * LEN + 1];
+	int i, j;
 
-	printf(",'");
-	for (i = 0; i < s; i++) {
-		if (v[i] == '\'')
-			printf("\\'");
-		else if (v[i] == '\\')
-			printf("\\\\");
-		else if (isprint(v[i]))
-			putchar(v[i]);
-		else
-			putchar('.');
+	for (i = j = 0; i < s; i++) {
+		if (v[i] == '\'' || v[i] == '\\') {
+			buf[j++] = '\\';
+			buf[j++] = v[i];
+		} else if (isprint(v[i])) {
+			buf[j++] = v[i];
+		} else {
+			buf[j++] = '.';
+		}
 	}
-	putchar('\'');
+	buf[j] = 0;
+
+	fc_val("'%s'", buf);
 }
 
 void flow(struct lfc *lfc, void *mydata,
@@ -83,5 +85,6 @@ struct module module = {
 	.size = sizeof(struct flowdata),
 	.header = header,
 	.pkt  = pkt,
+	.uses = FC_USES_PAYLOAD,
 	.flow = flow
 };
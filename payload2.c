@@ -61,9 +61,8 @@ static void print_buf(uint8_t *v, int s)
 {
 	int i;
 	for (i = 0; i < s; i++)
-		printf(",%d", v[i]);
-	for (; i < LEN; i++)
-		printf(",-1");
+		fc_val("%d", v[i]);
+	fc_def(LEN - s, "-1");
 }
 
 void flow(struct lfc *lfc, void *mydata,
@@ -79,5 +78,6 @@ struct module module = {
 	.size = sizeof(struct flowdata),
 	.header = header,
 	.pkt  = pkt,
+	.uses = FC_USES_PAYLOAD,
 	.flow = flow
 };
@@ -67,23 +67,28 @@ void pkt(struct lfc *lfc, void *plugin,
 	}
 }
 
+static void print_pks(struct pks *p)
+{
+	int i;
+
+	for (i = 0; i < p->cnt; i++)
+		fc_val("%d", p->size[i]);
+	fc_def(5 - p->cnt, "0");
+}
+
 void flow(struct lfc *lfc, void *pdata,
 	struct lfc_flow *lf, void *data)
 {
 	struct flow *f = data;
 
-	printf(",%d,%d,%d,%d,%d",
-		f->up.size[0], f->up.size[1], f->up.size[2],
-		f->up.size[3], f->up.size[4]);
-
-	printf(",%d,%d,%d,%d,%d",
-		f->down.size[0], f->down.size[1], f->down.size[2],
-		f->down.size[3], f->down.size[4]);
+	print_pks(&f->up);
+	print_pks(&f->down);
 }
 
 struct module module = {
 	.size = sizeof(struct flow),
 	.header = header,
 	.pkt  = pkt,
+	.uses = FC_USES_HEADERS,
 	.flow = flow
 };
@@ -0,0 +1,588 @@
+/*
+ * reffwrite: rewrite column values in ARFF files
+ * Copyright (c) 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Replaces the Python script by Paweł Foremski, 2013
+ *
+ * The ARFF file is mmap()-ed and cut into blocks of rows, which are rewritten in parallel and
+ * written in order. The column is found by memchr() for commas, and values are mapped through the
+ * dictionary stored in an open addressing hash table.
+ *
+ * Licensed under GNU GPL v. 3
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <libpjf/main.h>
+
+#include "reffwrite.h"
+
+struct reffwrite *rw;
+
+/** Prints usage help screen */
+static void help(void)
+{
+	printf("Usage: reffwrite [OPTIONS] <COLUMN> <DICTIONARY> [<ARFF FILE>]\n");
+	printf("\n");
+	printf("  Rewrites values of given ARFF column (number or name) according to a dictionary\n");
+	printf("  of 'source destination' lines. Reads standard input if no ARFF file given.\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -j <threads>           number of threads [number of CPUs]\n");
+	printf("  --verbose,-V           be verbose (alias for --debug=5)\n");
+	printf("  --debug=<num>          set debugging level\n");
+	printf("  --help,-h              show this usage help screen\n");
+	printf("  --version,-v           show version and copying information\n");
+}
+
+/** Prints version and copying information. */
+static void version(void)
+{
+	printf("reffwrite %s\n", REFFWRITE_VER);
+	printf("Copyright (C) 2026 IITiS PAN <http://www.iitis.pl/>\n");
+	printf("Licensed under GNU GPL v3\n");
+}
+
+/** Parses arguments
+ * @retval 0     ok
+ * @retval 1     error, main() should exit (eg. wrong arg. given)
+ * @retval 2     ok, but main() should exit (eg. on --version or --help) */
+static int parse_argv(int argc, char *argv[])
+{
+	int i, c;
+
+	static char *short_opts = "hvVj:";
+	static struct option long_opts[] = {
+		/* name, has_arg, NULL, short_ch */
+		{ "verbose",    0, NULL,  1  },
+		{ "debug",      1, NULL,  2  },
+		{ "help",       0, NULL,  3  },
+		{ "version",    0, NULL,  4  },
+		{ 0, 0, 0, 0 }
+	};
+
+	/* defaults */
+	debug = 0;
+	rw->arff_file = "-";
+
+	for (;;) {
+		c = getopt_long(argc, argv, short_opts, long_opts, &i);
+		if (c == -1) break; /* end of options */
+
+		switch (c) {
+			case 'V':
+			case  1 : debug = 5; break;
+			case  2 : debug = atoi(optarg); break;
+			case 'h':
+			case  3 : help(); return 2;
+			case 'v':
+			case  4 : version(); return 2;
+			case 'j': rw->threads = atoi(optarg); break;
+			default: help(); return 1;
+		}
+	}
+
+	if (argc - optind < 2) {
+		help();
+		return 1;
+	}
+
+	rw->colname = mmatic_strdup(rw->mm, argv[optind]);
+	rw->dict_file = mmatic_strdup(rw->mm, argv[optind+1]);
+	if (argc - optind > 2)
+		rw->arff_file = mmatic_strdup(rw->mm, argv[optind+2]);
+
+	if (rw->threads <= 0)
+		rw->threads = sysconf(_SC_NPROCESSORS_ONLN);
+	rw->threads = MAX(1, MIN(rw->threads, RW_MAXTHREADS));
+
+	return 0;
+}
+
+/*******************************/
+
+static uint32_t hash(const char *s, int len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len-- > 0) {
+		h ^= (uint8_t) *s++;
+		h *= 16777619U;
+	}
+
+	return h ^ (h >> 15);
+}
+
+/** Build the hash table: linear probing, at most half full */
+static void dict_build(struct dict *d)
+{
+	uint32_t size, i;
+	int j;
+
+	for (size = 16; size < 2 * d->n; size *= 2);
+
+	d->mask = size - 1;
+	d->tab = mmatic_zalloc(rw->mm, size * sizeof(struct entry *));
+
+	/* NB: sources are unique, see dict_read() */
+	for (j = 0; j < d->n; j++) {
+		for (i = hash(d->ent[j].src, d->ent[j].srclen) & d->mask; d->tab[i]; i = (i + 1) & d->mask);
+		d->tab[i] = &d->ent[j];
+	}
+
+	dbg(1, "dictionary: %d entries, table size %u\n", d->n, size);
+}
+
+/** Map value through dictionary
+ * @return  entry or NULL if not found */
+static inline struct entry *dict_get(struct dict *d, const char *s, int len)
+{
+	struct entry *e;
+	uint32_t i;
+
+	for (i = hash(s, len) & d->mask; (e = d->tab[i]); i = (i + 1) & d->mask) {
+		if (e->srclen == len && memcmp(e->src, s, len) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+/** Read dictionary file: "source destination" lines, # for comments */
+static void dict_read(struct dict *d, const char *path)
+{
+	FILE *fp;
+	char line[BUFSIZ], *src, *dst;
+	struct entry *e;
+	int i, size = 64;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		die("Opening dictionary '%s' failed: %m\n", path);
+
+	d->ent = mmatic_alloc(rw->mm, size * sizeof(struct entry));
+
+	while (fgets(line, sizeof line, fp)) {
+		src = strtok(line, " \t\r\n");
+		if (!src || src[0] == '#')
+			continue;
+
+		dst = strtok(NULL, " \t\r\n");
+		if (!dst)
+			die("Invalid dictionary line: no destination for '%s'\n", src);
+
+		/* last one wins */
+		for (i = 0; i < d->n; i++) {
+			if (streq(d->ent[i].src, src))
+				break;
+		}
+
+		if (i == d->n) {
+			if (d->n == size) {
+				size *= 2;
+				d->ent = mmatic_realloc(d->ent, size * sizeof(struct entry));
+			}
+			d->n++;
+		}
+
+		e = &d->ent[i];
+		e->src = mmatic_strdup(rw->mm, src);
+		e->srclen = strlen(src);
+		e->dst = mmatic_strdup(rw->mm, dst);
+		e->dstlen = strlen(dst);
+	}
+
+	fclose(fp);
+	dict_build(d);
+}
+
+/*******************************/
+
+/** Skip value starting at s: quoted values may contain commas
+ * @return  end of value: comma or eol */
+static const char *value_end(const char *s, const char *eol)
+{
+	const char *p = s, *c;
+
+	if (p < eol && (*p == '\'' || *p == '"')) {
+		for (p++; p < eol && *p != *s; p++) {
+			if (*p == '\\') p++;
+		}
+		if (p < eol) p++;
+	}
+
+	c = memchr(p, ',', eol - p);
+	return c ? c : eol;
+}
+
+/** End of line without the line break */
+static const char *line_end(const char *s, const char *eol)
+{
+	while (eol > s && (eol[-1] == '\n' || eol[-1] == '\r'))
+		eol--;
+
+	return eol;
+}
+
+/** Rewrite a nominal attribute declaration: @attribute name {a,b,c} */
+static void rewrite_nominal(const char *s, const char *eol)
+{
+	const char *open, *close, *v, *ve;
+	char *val;
+	int len;
+	struct entry *e;
+	thash *seen;
+
+	open = memchr(s, '{', eol - s);
+	close = line_end(s, eol);
+	while (open && close > open && close[-1] != '}') close--;
+
+	if (!open || close <= open) {
+		fwrite(s, 1, eol - s, stdout);
+		return;
+	}
+
+	fwrite(s, 1, open + 1 - s, stdout);
+
+	seen = thash_create_strkey(NULL, rw->mm);
+	for (v = open + 1; v < close - 1; v = ve + 1) {
+		while (v < close - 1 && isspace(*v)) v++;
+		ve = value_end(v, close - 1);
+		for (len = ve - v; len > 0 && isspace(v[len - 1]); len--);
+
+		e = dict_get(&rw->dict, v, len);
+		if (e) {
+			v = e->dst;
+			len = e->dstlen;
+		}
+
+		/* NB: many values may map to one */
+		val = mmatic_alloc(rw->mm, len + 1);
+		memcpy(val, v, len);
+		val[len] = '\0';
+		if (thash_get(seen, val))
+			continue;
+
+		if (thash_count(seen) > 0) putchar(',');
+		thash_set(seen, val, val);
+		fwrite(v, 1, len, stdout);
+	}
+
+	fwrite(close - 1, 1, eol - (close - 1), stdout);
+}
+
+/** Copy the ARFF header to stdout, find the column and start of data */
+static void header(void)
+{
+	const char *p = rw->data, *end = rw->data + rw->len, *eol, *s, *se;
+	char *name;
+	int attr = 0;
+	bool isnum;
+
+	/* column number given? */
+	rw->col = strtol(rw->colname, &name, 10) - 1;
+	isnum = (*name == '\0' && rw->col >= 0);
+	if (!isnum)
+		rw->col = -1;
+
+	for (; p < end; p = eol) {
+		eol = memchr(p, '\n', end - p);
+		eol = eol ? eol + 1 : end;
+
+		/* first data row? */
+		if (isdigit(*p) || *p == '{')
+			break;
+
+		if (eol - p > 10 && strncasecmp(p, "@attribute", 10) == 0 && isspace(p[10])) {
+			/* attribute name */
+			for (s = p + 10; s < eol && isspace(*s); s++);
+			for (se = s; se < eol && !isspace(*se); se++);
+			name = mmatic_alloc(rw->mm, se - s + 1);
+			memcpy(name, s, se - s);
+			name[se - s] = '\0';
+
+			if (!isnum && streq(name, rw->colname))
+				rw->col = attr;
+
+			if (attr++ == rw->col) {
+				rewrite_nominal(p, eol);
+				continue;
+			}
+		}
+
+		fwrite(p, 1, eol - p, stdout);
+
+		if (eol - p >= 5 && strncasecmp(p, "@data", 5) == 0) {
+			p = eol;
+			break;
+		}
+	}
+
+	if (rw->col < 0)
+		die("Column '%s' not found\n", rw->colname);
+
+	rw->datapos = p - rw->data;
+}
+
+/** Find the column value in a data row
+ * @param v   start of the value
+ * @param ve  end of the value
+ * @return    dictionary entry for the value, NULL if none */
+static struct entry *row_col(const char *p, const char *eol, const char **v, const char **ve)
+{
+	const char *end;
+	int i;
+
+	/* sparse row: {index value,...}, in order of index */
+	if (*p == '{') {
+		end = line_end(p, eol);
+		if (end > p && end[-1] == '}') end--;
+
+		for (*v = p + 1; *v < end; *v = *ve + 1) {
+			while (*v < end && isspace(**v)) (*v)++;
+			for (i = 0; *v < end && isdigit(**v); (*v)++)
+				i = MIN(10 * i + (**v - '0'), RW_MAXCOL);
+			while (*v < end && isspace(**v)) (*v)++;
+
+			*ve = value_end(*v, end);
+			if (i == rw->col)
+				return dict_get(&rw->dict, *v, *ve - *v);
+			if (i > rw->col || *ve == end)
+				break;
+		}
+
+		return NULL;
+	}
+
+	if (!isdigit(*p))
+		return NULL;
+
+	*v = p;
+	for (i = 0; i < rw->col; i++) {
+		*ve = value_end(*v, eol);
+		if (*ve == eol) return NULL;
+		*v = *ve + 1;
+	}
+
+	*ve = value_end(*v, eol);
+	if (*ve == eol) *ve = line_end(*v, eol);
+	return dict_get(&rw->dict, *v, *ve - *v);
+}
+
+/** Rewrite rows of a block */
+static void rewrite(struct block *b)
+{
+	const char *p = b->in, *end = b->in + b->inlen, *eol, *v = NULL, *ve = NULL;
+	size_t size, len;
+	struct entry *e;
+
+	size = b->inlen + b->inlen / 4 + 4096;
+	b->out = malloc(size);
+	if (!b->out)
+		die("Out of memory\n");
+
+	for (; p < end; p = eol) {
+		eol = memchr(p, '\n', end - p);
+		eol = eol ? eol + 1 : end;
+
+		e = row_col(p, eol, &v, &ve);
+
+		len = (eol - p) + (e ? e->dstlen : 0);
+		if (b->outlen + len > size) {
+			size = 2 * size + len;
+			b->out = realloc(b->out, size);
+			if (!b->out)
+				die("Out of memory\n");
+		}
+
+		if (e) {
+			memcpy(b->out + b->outlen, p, v - p);
+			b->outlen += v - p;
+			memcpy(b->out + b->outlen, e->dst, e->dstlen);
+			b->outlen += e->dstlen;
+			memcpy(b->out + b->outlen, ve, eol - ve);
+			b->outlen += eol - ve;
+		} else {
+			memcpy(b->out + b->outlen, p, eol - p);
+			b->outlen += eol - p;
+		}
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct block *b;
+
+	for (;;) {
+		/* NB: stay close to the writer, not to keep all output in memory */
+		pthread_mutex_lock(&rw->lock);
+		while (rw->next_work < rw->nblocks && rw->next_work - rw->next_out >= 2 * rw->threads)
+			pthread_cond_wait(&rw->cond, &rw->lock);
+
+		if (rw->next_work == rw->nblocks) {
+			pthread_mutex_unlock(&rw->lock);
+			break;
+		}
+
+		b = &rw->blocks[rw->next_work++];
+		pthread_mutex_unlock(&rw->lock);
+
+		rewrite(b);
+
+		pthread_mutex_lock(&rw->lock);
+		b->done = true;
+		pthread_cond_broadcast(&rw->cond);
+		pthread_mutex_unlock(&rw->lock);
+	}
+
+	return NULL;
+}
+
+/** Cut data rows into blocks, on line boundaries */
+static void cut(void)
+{
+	size_t pos = rw->datapos, next;
+	const char *eol;
+	int size = 64;
+
+	rw->blocks = mmatic_zalloc(rw->mm, size * sizeof(struct block));
+
+	while (pos < rw->len) {
+		next = MIN(pos + RW_BLOCK, rw->len);
+		if (next < rw->len) {
+			eol = memchr(rw->data + next, '\n', rw->len - next);
+			next = eol ? eol + 1 - rw->data : rw->len;
+		}
+
+		if (rw->nblocks == size) {
+			size *= 2;
+			rw->blocks = mmatic_realloc(rw->blocks, size * sizeof(struct block));
+		}
+
+		memset(&rw->blocks[rw->nblocks], 0, sizeof(struct block));
+		rw->blocks[rw->nblocks].in = rw->data + pos;
+		rw->blocks[rw->nblocks].inlen = next - pos;
+		rw->nblocks++;
+
+		pos = next;
+	}
+}
+
+/** Map the input file, or read stdin */
+static void input(void)
+{
+	struct stat st;
+	size_t size = 0;
+	ssize_t rv;
+	char *buf = NULL;
+	int fd;
+
+	if (streq(rw->arff_file, "-")) {
+		fd = 0;
+	} else {
+		fd = open(rw->arff_file, O_RDONLY);
+		if (fd < 0)
+			die("Opening '%s' failed: %m\n", rw->arff_file);
+	}
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		rw->len = st.st_size;
+		if (rw->len == 0)
+			return;
+
+		rw->data = mmap(NULL, rw->len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (rw->data == MAP_FAILED)
+			die("Mapping '%s' failed: %m\n", rw->arff_file);
+
+		madvise((void *) rw->data, rw->len, MADV_SEQUENTIAL);
+		return;
+	}
+
+	/* eg. a pipe */
+	for (;;) {
+		if (rw->len == size) {
+			size = size ? 2 * size : RW_BLOCK;
+			buf = realloc(buf, size);
+			if (!buf)
+				die("Out of memory\n");
+		}
+
+		rv = read(fd, buf + rw->len, size - rw->len);
+		if (rv < 0)
+			die("Reading '%s' failed: %m\n", rw->arff_file);
+		if (rv == 0)
+			break;
+		rw->len += rv;
+	}
+
+	rw->data = buf;
+}
+
+int main(int argc, char *argv[])
+{
+	mmatic *mm;
+	struct block *b;
+	int i;
+
+	/*
+	 * initialization
+	 */
+	mm = mmatic_create();
+	rw = mmatic_zalloc(mm, sizeof *rw);
+	rw->mm = mm;
+
+	/* read options */
+	if (parse_argv(argc, argv))
+		return 1;
+
+	dict_read(&rw->dict, rw->dict_file);
+	input();
+	header();
+	fflush(stdout);
+
+	/*
+	 * rewrite rows on worker threads, write them in order
+	 */
+	cut();
+	pthread_mutex_init(&rw->lock, NULL);
+	pthread_cond_init(&rw->cond, NULL);
+
+	for (i = 0; i < rw->threads; i++)
+		pthread_create(&rw->workers[i], NULL, worker, NULL);
+
+	for (i = 0; i < rw->nblocks; i++) {
+		b = &rw->blocks[i];
+
+		pthread_mutex_lock(&rw->lock);
+		while (!b->done)
+			pthread_cond_wait(&rw->cond, &rw->lock);
+		pthread_mutex_unlock(&rw->lock);
+
+		if (fwrite(b->out, 1, b->outlen, stdout) != b->outlen)
+			die("Writing output failed: %m\n");
+		free(b->out);
+
+		pthread_mutex_lock(&rw->lock);
+		rw->next_out++;
+		pthread_cond_broadcast(&rw->cond);
+		pthread_mutex_unlock(&rw->lock);
+	}
+
+	for (i = 0; i < rw->threads; i++)
+		pthread_join(rw->workers[i], NULL);
+
+	if (fflush(stdout) != 0)
+		die("Writing output failed: %m\n");
+
+	mmatic_destroy(mm);
+	return 0;
+}
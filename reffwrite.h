@@ -0,0 +1,74 @@
+/*
+ * reffwrite: rewrite column values in ARFF files
+ *
+ * Copyright (c) 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Licensed under GNU GPL v. 3
+ */
+
+#ifndef _REFFWRITE_H_
+#define _REFFWRITE_H_
+
+#include <pthread.h>
+#include <libpjf/lib.h>
+
+#define REFFWRITE_VER "0.2"
+
+/** Approx. size of input block rewritten by one thread */
+#define RW_BLOCK (8 << 20)
+
+/** Max. number of threads */
+#define RW_MAXTHREADS 64
+
+/** Max. column index in sparse rows, larger ones are cut to it */
+#define RW_MAXCOL (1 << 24)
+
+/** Dictionary entry */
+struct entry {
+	const char *src;        /**> source value */
+	int srclen;             /**> length of src */
+	const char *dst;        /**> destination value */
+	int dstlen;             /**> length of dst */
+};
+
+/** Dictionary in an open addressing hash table */
+struct dict {
+	struct entry *ent;      /**> entries */
+	int n;                  /**> number of entries */
+	struct entry **tab;     /**> hash table, linear probing: NULL = empty slot */
+	uint32_t mask;          /**> table size - 1 */
+};
+
+/** A block of rows */
+struct block {
+	const char *in;         /**> input rows */
+	size_t inlen;           /**> input length */
+	char *out;              /**> rewritten rows */
+	size_t outlen;          /**> output length */
+	bool done;              /**> rewritten? */
+};
+
+struct reffwrite {
+	mmatic *mm;             /**> memory */
+
+	const char *colname;    /**> column name or number, as given by user */
+	int col;                /**> column index (0-based) */
+	const char *dict_file;  /**> dictionary file */
+	struct dict dict;       /**> dictionary */
+	const char *arff_file;  /**> input ARFF file, "-" for stdin */
+	int threads;            /**> number of threads */
+
+	const char *data;       /**> input file contents */
+	size_t len;             /**> input file length */
+	size_t datapos;         /**> start of data rows */
+
+	struct block *blocks;   /**> blocks of data rows */
+	int nblocks;            /**> number of blocks */
+	int next_work;          /**> next block to rewrite */
+	int next_out;           /**> next block to write */
+
+	pthread_mutex_t lock;   /**> protects the above */
+	pthread_cond_t cond;    /**> signals any change of the above */
+	pthread_t workers[RW_MAXTHREADS]; /**> rewrite blocks */
+};
+
+#endif
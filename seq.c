@@ -0,0 +1,266 @@
+/*
+ * seq - sizes, inter-arrival times and TCP flags of first N packets
+ *
+ * Options (see flowcalc -o):
+ *   seq_n=<N>             number of packets to record [10]
+ *   seq_dir=split|signed  split: N packets in each direction [default]
+ *                         signed: first N packets in both directions, sizes down are negative
+ *   seq_iat=1             add inter-arrival times [us] to previous packet in the sequence
+ *   seq_flags=1           add TCP flags
+ *   seq_empty=1           record packets without payload too
+ *   seq_filter=tls        record TLS application data only (as in websize)
+ *
+ * Copyright (c) 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Licensed under GNU GPL v. 3
+ */
+
+#include <libtrace.h>
+#include <libpjf/lib.h>
+#include "flowcalc.h"
+
+/* max. sequence length */
+#define SEQ_MAX 10000
+
+struct conf {
+	int n;                     /**> sequence length (per direction if split) */
+	bool split;                /**> per-direction sequences? */
+	bool iat;                  /**> record IATs? */
+	bool flags;                /**> record TCP flags? */
+	bool empty;                /**> record packets without payload? */
+	bool tls;                  /**> record TLS application data only? */
+
+	int slots;                 /**> number of packets to record */
+	int off_iat;               /**> offset of uint32_t iat[slots] in flow data */
+	int off_flags;             /**> offset of uint16_t flags[slots] in flow data */
+	int off_dir;               /**> offset of uint8_t dir[slots / 8] in flow data (signed only) */
+};
+
+/* Per-flow data block: struct flow, uint16_t size[slots], then optional channels, see struct conf
+ * NB: if split, first N slots are for packets up, next N for packets down */
+struct flow {
+	bool done;                 /**> sequence complete: ignore next packets */
+	bool indata[2];            /**> TLS application data seen (down, up) */
+	uint16_t cnt[2];           /**> number of packets recorded (down, up); cnt[0] if signed */
+	int64_t last_ts[2];        /**> timestamp of last packet recorded [ns] (down, up); last_ts[0] if signed */
+};
+
+/* defined at the end, init() updates the flow data size and what it uses */
+extern struct module module;
+
+/*****************************/
+
+static bool opt_bool(struct flowcalc *fc, const char *name)
+{
+	const char *opt = thash_get(fc->opts, name);
+
+	return opt && !streq(opt, "0") && !streq(opt, "no");
+}
+
+bool init(struct lfc *lfc, void **pdata, struct flowcalc *fc)
+{
+	struct conf *conf;
+	const char *opt;
+	int size;
+
+	conf = mmatic_zalloc(lfc->mm, sizeof *conf);
+
+	opt = thash_get(fc->opts, "seq_n");
+	conf->n = opt ? atoi(opt) : 10;
+	if (conf->n < 1 || conf->n > SEQ_MAX) {
+		dbg(0, "seq: seq_n must be in range 1-%d\n", SEQ_MAX);
+		return false;
+	}
+
+	opt = thash_get(fc->opts, "seq_dir");
+	if (!opt || streq(opt, "split")) {
+		conf->split = true;
+	} else if (!streq(opt, "signed")) {
+		dbg(0, "seq: invalid seq_dir: %s\n", opt);
+		return false;
+	}
+
+	opt = thash_get(fc->opts, "seq_filter");
+	if (opt && streq(opt, "tls")) {
+		conf->tls = true;
+	} else if (opt) {
+		dbg(0, "seq: invalid seq_filter: %s\n", opt);
+		return false;
+	}
+
+	conf->iat = opt_bool(fc, "seq_iat");
+	conf->flags = opt_bool(fc, "seq_flags");
+	conf->empty = opt_bool(fc, "seq_empty");
+
+	/* lay out the flow data block */
+	conf->slots = conf->split ? 2 * conf->n : conf->n;
+	size = sizeof(struct flow) + conf->slots * sizeof(uint16_t);
+
+	if (conf->iat) {
+		size = (size + 3) & ~3;
+		conf->off_iat = size;
+		size += conf->slots * sizeof(uint32_t);
+	}
+
+	if (conf->flags) {
+		conf->off_flags = size;
+		size += conf->slots * sizeof(uint16_t);
+	}
+
+	if (!conf->split) {
+		conf->off_dir = size;
+		size += (conf->slots + 7) / 8;
+	}
+
+	module.size = size;
+	if (conf->tls)
+		module.uses |= FC_USES_PAYLOAD;
+
+	*pdata = conf;
+	return true;
+}
+
+/** Print attributes of one channel */
+static void header_ch(struct conf *conf, const char *name, const char *descr)
+{
+	int i;
+
+	if (conf->split) {
+		printf("%% sq_%s_N_up:   %s of Nth packet up\n", name, descr);
+		printf("%% sq_%s_N_down: %s of Nth packet down\n", name, descr);
+		for (i = 1; i <= conf->n; i++)
+			printf("@attribute sq_%s_%d_up numeric\n", name, i);
+		for (i = 1; i <= conf->n; i++)
+			printf("@attribute sq_%s_%d_down numeric\n", name, i);
+	} else {
+		printf("%% sq_%s_N:      %s of Nth packet\n", name, descr);
+		for (i = 1; i <= conf->n; i++)
+			printf("@attribute sq_%s_%d numeric\n", name, i);
+	}
+}
+
+void header(struct lfc *lfc, void *pdata, struct flowcalc *fc)
+{
+	struct conf *conf = pdata;
+
+	printf("%%%% seq 0.1\n");
+
+	header_ch(conf, "size", conf->split ? "payload size" : "payload size (negative if down)");
+	if (conf->iat)
+		header_ch(conf, "iat", "inter-arrival time [us]");
+	if (conf->flags)
+		header_ch(conf, "flags", "TCP flags");
+}
+
+/** Check if packet holds TLS application data (just first 3 bytes) */
+static bool is_tls_data(struct lfc_pkt *pkt)
+{
+	uint8_t *v = pkt->data;
+
+	if (!pkt->tcp || !v || pkt->len < 3) return false;
+
+	if (v[0] != 0x17) return false; /* TLS Protocol Type must be Application */
+	if (v[1] != 3)    return false; /* TLS major version must be 3 */
+	if (v[2] > 3)     return false; /* TLS minor version must be <= 3 */
+
+	return true;
+}
+
+void pkt(struct lfc *lfc, void *pdata,
+	struct lfc_flow *lf, struct lfc_pkt *pkt, void *data)
+{
+	struct conf *conf = pdata;
+	struct flow *f = data;
+	uint8_t *block = data;
+	int dir, i;
+	int64_t ts, iat;
+
+	if (f->done || pkt->dup) return;
+
+	/* packet useful? */
+	if (pkt->psize == 0 && !conf->empty) return;
+
+	if (conf->tls) {
+		/* skip TLS setup and non-DATA frames (SPDY/H2), as in websize */
+		if (pkt->psize < 5) return;
+		if (!f->indata[pkt->up]) {
+			if (!is_tls_data(pkt)) return;
+			f->indata[pkt->up] = true;
+		}
+		if (pkt->psize < 80) return;
+	}
+
+	/* slot for this packet */
+	dir = conf->split ? pkt->up : 0;
+	if (f->cnt[dir] == conf->n) return;
+	i = f->cnt[dir]++;
+	if (conf->split && !pkt->up) i += conf->n;
+
+	/* record! */
+	((uint16_t *) (f + 1))[i] = MIN(pkt->psize, UINT16_MAX);
+
+	if (conf->iat) {
+		ts = fc_ts(pkt);
+		iat = (f->last_ts[dir] > 0 && ts > f->last_ts[dir]) ? (ts - f->last_ts[dir] + 500) / 1000 : 0;
+		((uint32_t *) (block + conf->off_iat))[i] = MIN(iat, UINT32_MAX);
+		f->last_ts[dir] = ts;
+	}
+
+	if (conf->flags)
+		((uint16_t *) (block + conf->off_flags))[i] = pkt->tcp ? ((uint8_t *) pkt->tcp)[13] : 0;
+
+	if (!conf->split && !pkt->up)
+		block[conf->off_dir + i / 8] |= 1 << (i % 8);
+
+	/* done? */
+	if (f->cnt[dir] == conf->n && (!conf->split || f->cnt[!dir] == conf->n))
+		f->done = true;
+}
+
+void flow(struct lfc *lfc, void *pdata,
+	struct lfc_flow *lf, void *data)
+{
+	struct conf *conf = pdata;
+	uint8_t *block = data;
+	uint16_t *size = (uint16_t *) ((struct flow *) data + 1);
+	uint32_t *iat;
+	uint16_t *flags;
+	int i;
+
+	for (i = 0; i < conf->slots; i++) {
+		if (!size[i])
+			fc_def(1, "0");
+		else if (!conf->split && block[conf->off_dir + i / 8] & (1 << (i % 8)))
+			fc_val("-%u", size[i]);
+		else
+			fc_val("%u", size[i]);
+	}
+
+	if (conf->iat) {
+		iat = (uint32_t *) (block + conf->off_iat);
+		for (i = 0; i < conf->slots; i++) {
+			if (iat[i])
+				fc_val("%u", iat[i]);
+			else
+				fc_def(1, "0");
+		}
+	}
+
+	if (conf->flags) {
+		flags = (uint16_t *) (block + conf->off_flags);
+		for (i = 0; i < conf->slots; i++) {
+			if (flags[i])
+				fc_val("%u", flags[i]);
+			else
+				fc_def(1, "0");
+		}
+	}
+}
+
+struct module module = {
+	.size = sizeof(struct flow),
+	.init = init,
+	.header = header,
+	.pkt  = pkt,
+	.uses = FC_USES_HEADERS,
+	.flow = flow
+};
@@ -7,23 +7,57 @@
  */
 
 #include <math.h>
+#include <inttypes.h>
+#include <libpjf/lib.h>
 #include "flowcalc.h"
 
+/* default quantile sketch size [bytes], see the stats_qbytes option
+ * NB: gives buckets 1/16 of the value wide for sizes, 1/8 for IATs */
+#define QBYTES 512
+
+/* max. number of quantiles, see the stats_quantiles option */
+#define QMAX 16
+
+/* A log-bucket histogram: value v lands in bucket of width 2^-m relative to v */
+struct sketch {
+	int m;                     /**> mantissa bits */
+	int nb;                    /**> number of uint16_t counters */
+};
+
+struct conf {
+	int nq;                    /**> number of quantiles, 0 = no sketches */
+	double q[QMAX];            /**> quantiles [%] */
+
+	struct sketch size;        /**> payload size sketch: 16-bit values */
+	struct sketch iat;         /**> inter-arrival time sketch: 32-bit values [us] */
+};
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+/* Running moments: exact integer sums of values shifted by the first value (no cancellation)
+ * NB: used instead of Welford's update, which needs a division per value */
+struct moments {
+	uint64_t n;                /**> number of values */
+	uint64_t shift;            /**> first value */
+	int64_t sum;               /**> sum of (x - shift) */
+	uint128_t sumsq;           /**> sum of (x - shift)^2 */
+};
+
 struct stats {
-	uint64_t pkts;
-
-	uint16_t pktlen_min;
-	uint16_t pktlen_max;
-	double pktlen_mean;
-	double pktlen_var;
-
-	double last_ts;
-	double iat_min;
-	double iat_max;
-	double iat_mean;
-	double iat_var;
+	uint16_t size_min;         /**> min. payload size */
+	uint16_t size_max;         /**> max. payload size */
+	struct moments size;       /**> payload size moments */
+
+	int64_t last_ts;           /**> timestamp of last payload packet [ns] */
+	uint64_t iat_min;          /**> min. inter-arrival time [ns] */
+	uint64_t iat_max;          /**> max. inter-arrival time [ns] */
+	struct moments iat;        /**> inter-arrival time moments [ns] */
 };
 
+/* defined at the end, init() updates the flow data size */
+extern struct module module;
+
+/* NB: with quantiles enabled, followed by the sketch counters: size up, iat up, size down, iat down */
 struct flow {
 	struct stats up;
 	struct stats down;
@@ -31,8 +65,170 @@ struct flow {
 
 /*****************************/
 
-void header()
+/** Add value x: a few integer instructions, no divisions */
+static inline void moments_add(struct moments *m, uint64_t x)
+{
+	int64_t d;
+
+	if (m->n++ == 0)
+		m->shift = x;
+
+	d = x - m->shift;
+	m->sum += d;
+	m->sumsq += (__extension__ (__int128) d * d);
+}
+
+/** Get mean and sample standard deviation for a batch of moments
+ * NB: the second loop is branch-free so that it vectorizes
+ * NB: flows are printed one by one as they expire, so flow() gives the 4 moments of one flow
+ * NB: checked against a two-pass reference by tools/statscheck */
+static void moments_finish(const struct moments *m, int num, double *mean, double *std)
+{
+	double n[num], sum[num], m2[num], shift[num];
+	int i;
+
+	for (i = 0; i < num; i++) {
+		n[i] = m[i].n;
+		sum[i] = m[i].sum;
+		shift[i] = m[i].shift;
+
+		/* sum of squared deviations from the mean */
+		m2[i] = m[i].n ? (long double) m[i].sumsq - (long double) m[i].sum * m[i].sum / m[i].n : 0;
+	}
+
+	for (i = 0; i < num; i++) {
+		mean[i] = shift[i] + sum[i] / fmax(n[i], 1);
+		std[i] = sqrt(fmax(m2[i], 0) / fmax(n[i] - 1, 1));
+	}
+}
+
+/** Choose sketch resolution for given value range [bits] and memory budget [bytes] */
+static void sketch_init(struct sketch *sk, int bits, int budget)
+{
+	/* buckets: 2^m exact small values, then 2^m per power of 2 */
+	for (sk->m = 7; sk->m > 0 && ((bits - sk->m + 1) << sk->m) * 2 > budget; sk->m--);
+
+	sk->nb = MIN((bits - sk->m + 1) << sk->m, budget / 2);
+}
+
+/** Sketch bucket for value v */
+static inline int sketch_idx(struct sketch *sk, uint32_t v)
+{
+	int e, idx;
+
+	if (v < (1U << sk->m))
+		return v;
+
+	e = 31 - __builtin_clz(v);
+	idx = ((e - sk->m + 1) << sk->m) + ((v >> (e - sk->m)) & ((1 << sk->m) - 1));
+
+	return MIN(idx, sk->nb - 1);
+}
+
+/** Count value v in sketch counters c
+ * NB: sketches are mergeable by adding counters bucket-wise */
+static inline void sketch_add(struct sketch *sk, uint16_t *c, uint32_t v)
+{
+	int i;
+
+	/* saturated? halve all counters: keeps the distribution */
+	if (++c[sketch_idx(sk, v)] == UINT16_MAX) {
+		for (i = 0; i < sk->nb; i++)
+			c[i] >>= 1;
+	}
+}
+
+/** Get value at given quantile [%], middle of the matching bucket */
+static double sketch_get(struct sketch *sk, uint16_t *c, double q)
+{
+	uint64_t total = 0, rank, sum = 0;
+	uint32_t lo, width;
+	int i, e;
+
+	for (i = 0; i < sk->nb; i++)
+		total += c[i];
+	if (total == 0)
+		return 0;
+
+	rank = ceil(q / 100.0 * total);
+	if (rank < 1) rank = 1;
+
+	for (i = 0; i < sk->nb - 1; i++) {
+		sum += c[i];
+		if (sum >= rank) break;
+	}
+
+	if (i < (1 << sk->m))
+		return i;
+
+	e = (i >> sk->m) + sk->m - 1;
+	width = 1U << (e - sk->m);
+	lo = ((1U << sk->m) + (i & ((1 << sk->m) - 1))) * width;
+
+	return lo + (width - 1) / 2.0;
+}
+
+bool init(struct lfc *lfc, void **pdata, struct flowcalc *fc)
 {
+	struct conf *conf;
+	const char *opt;
+	char *str, *tok;
+	int budget;
+
+	conf = mmatic_zalloc(lfc->mm, sizeof *conf);
+
+	/* quantiles to print, e.g. 50,90,99 */
+	opt = thash_get(fc->opts, "stats_quantiles");
+	if (opt) {
+		str = mmatic_strdup(lfc->mm, opt);
+		for (tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+			if (conf->nq == QMAX) {
+				dbg(0, "stats: too many quantiles (max. %d)\n", QMAX);
+				return false;
+			}
+
+			conf->q[conf->nq] = strtod(tok, NULL);
+			if (conf->q[conf->nq] <= 0 || conf->q[conf->nq] > 100) {
+				dbg(0, "stats: invalid quantile: %s\n", tok);
+				return false;
+			}
+			conf->nq++;
+		}
+	}
+
+	/* memory budget per sketch */
+	opt = thash_get(fc->opts, "stats_qbytes");
+	budget = opt ? atoi(opt) : QBYTES;
+	if (budget < 16) {
+		dbg(0, "stats: stats_qbytes must be at least 16\n");
+		return false;
+	}
+
+	if (conf->nq > 0) {
+		sketch_init(&conf->size, 16, budget);
+		sketch_init(&conf->iat, 32, budget);
+		module.size += 2 * (conf->size.nb + conf->iat.nb) * sizeof(uint16_t);
+	}
+
+	*pdata = conf;
+	return true;
+}
+
+/** Print sketch attributes */
+static void header_q(struct conf *conf, const char *name, const char *descr)
+{
+	int i;
+
+	for (i = 0; i < conf->nq; i++)
+		printf("%% bs_p%g_%s: %g-th percentile of %s\n", conf->q[i], name, conf->q[i], descr);
+	for (i = 0; i < conf->nq; i++)
+		printf("@attribute bs_p%g_%s numeric\n", conf->q[i], name);
+}
+
+void header(struct lfc *lfc, void *pdata, struct flowcalc *fc)
+{
+	struct conf *conf = pdata;
+
 	printf("%%%% stats 0.1\n");
 	printf("%% bs_min_size_up: minimum payload size in forward direction\n");
 	printf("%% bs_avg_size_up: average payload size in forward direction\n");
@@ -67,92 +263,137 @@ void header()
 	printf("@attribute bs_avg_iat_down numeric\n");
 	printf("@attribute bs_max_iat_down numeric\n");
 	printf("@attribute bs_std_iat_down numeric\n");
+
+	if (conf->nq > 0) {
+		header_q(conf, "size_up", "payload size in forward direction");
+		header_q(conf, "size_down", "payload size in backward direction");
+		header_q(conf, "iat_up", "inter-arrival time in forward direction");
+		header_q(conf, "iat_down", "inter-arrival time in backward direction");
+	}
 }
 
 void pkt(struct lfc *lfc, void *plugin,
 	struct lfc_flow *lf, struct lfc_pkt *pkt, void *data)
 {
+	struct conf *conf = plugin;
 	struct flow *flow = data;
 	struct stats *is;
-	double iat, n;
+	uint16_t *sk;
+	uint64_t iat;
+	int64_t ts;
 
 	if (pkt->first) {
-		flow->up.pktlen_min = UINT16_MAX;
-		flow->down.pktlen_min = UINT16_MAX;
-		flow->up.iat_min = -1;
-		flow->down.iat_min = -1;
+		flow->up.size_min = UINT16_MAX;
+		flow->down.size_min = UINT16_MAX;
+		flow->up.iat_min = UINT64_MAX;
+		flow->down.iat_min = UINT64_MAX;
 	}
 
 	if (pkt->dup) return;
 	if (pkt->psize == 0) return;
 
 	is = (pkt->up ? &flow->up : &flow->down);
-	is->pkts++;
-	n = is->pkts;
+
+	/* sketch counters for this direction */
+	sk = (uint16_t *) (flow + 1);
+	if (!pkt->up) sk += conf->size.nb + conf->iat.nb;
 
 	/*
 	 * payload length statistics
 	 */
-	if (pkt->psize < is->pktlen_min) is->pktlen_min = pkt->psize;
-	if (pkt->psize > is->pktlen_max) is->pktlen_max = pkt->psize;
+	if (pkt->psize < is->size_min) is->size_min = pkt->psize;
+	if (pkt->psize > is->size_max) is->size_max = pkt->psize;
+	moments_add(&is->size, pkt->psize);
 
-	if (n > 1)
-		is->pktlen_var = (n-2)/(n-1)*is->pktlen_var + 1/n*pow(pkt->psize - is->pktlen_mean, 2.);
-	is->pktlen_mean = (pkt->psize + (n-1)*is->pktlen_mean) / n;
+	if (conf->nq > 0)
+		sketch_add(&conf->size, sk, pkt->psize);
 
 	/*
 	 * payload packet inter-arrival time stats
 	 */
-	if (is->last_ts > 0 && pkt->ts > is->last_ts) {
-		iat = (pkt->ts - is->last_ts) * 1000.;
+	ts = fc_ts(pkt);
+	if (is->last_ts > 0 && ts > is->last_ts) {
+		iat = ts - is->last_ts;
 
-		if (is->iat_min < 0 || iat < is->iat_min) is->iat_min = iat;
+		if (iat < is->iat_min) is->iat_min = iat;
 		if (iat > is->iat_max) is->iat_max = iat;
+		moments_add(&is->iat, iat);
 
-		if (n > 1)
-			is->iat_var = (n-2)/(n-1)*is->iat_var + 1/n*pow(iat - is->iat_mean, 2.);
-		is->iat_mean = (iat + (n-1)*is->iat_mean) / n;
+		if (conf->nq > 0)
+			sketch_add(&conf->iat, sk + conf->size.nb, MIN(iat / 1000, UINT32_MAX));
 	}
 
 	/* update timestamp of last pkt in this direction */
-	is->last_ts = pkt->ts;
+	is->last_ts = ts;
 }
 
 void flow(struct lfc *lfc, void *pdata,
 	struct lfc_flow *lf, void *data)
 {
+	struct conf *conf = pdata;
 	struct flow *flow = data;
 	struct stats *is;
-	int i;
+	struct moments m[4];
+	double mean[4], std[4];
+	uint16_t *sk;
+	int i, j;
+
+	/* finalize all at once: size up, size down, iat up, iat down */
+	m[0] = flow->up.size;
+	m[1] = flow->down.size;
+	m[2] = flow->up.iat;
+	m[3] = flow->down.iat;
+	moments_finish(m, 4, mean, std);
 
 	/* print packet length statistics */
 	is = &flow->up;
 	for (i = 0; i < 2; i++) {
-		if (is->pkts == 0) {
-			printf(",0,0,0,0");
+		if (is->size.n == 0) {
+			fc_def(4, "0");
 		} else {
-			printf(",%u,%.0f,%u,%.0f",
-				is->pktlen_min, is->pktlen_mean, is->pktlen_max, sqrt(is->pktlen_var));
+			fc_val("%u", is->size_min);
+			fc_val("%.0f", mean[i]);
+			fc_val("%u", is->size_max);
+			fc_val("%.0f", std[i]);
 		}
 		is = &flow->down;
 	}
 
-	/* print inter-arrival time statistics */
+	/* print inter-arrival time statistics [ms] */
 	is = &flow->up;
 	for (i = 0; i < 2; i++) {
-		if (is->pkts < 2) {
-			printf(",0,0,0,0");
+		if (is->iat.n == 0) {
+			fc_def(4, "0");
 		} else {
-			printf(",%.0f,%.0f,%.0f,%.0f",
-				is->iat_min, is->iat_mean, is->iat_max, sqrt(is->iat_var / is->pkts));
+			fc_val("%"PRIu64, (is->iat_min + 500000) / 1000000);
+			fc_val("%.0f", mean[2 + i] / 1e6);
+			fc_val("%"PRIu64, (is->iat_max + 500000) / 1000000);
+			fc_val("%.0f", std[2 + i] / 1e6);
 		}
 		is = &flow->down;
 	}
+
+	/* print quantiles: size up, size down, iat up, iat down */
+	if (conf->nq == 0)
+		return;
+
+	sk = (uint16_t *) (flow + 1);
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < conf->nq; j++)
+			fc_val("%.0f", sketch_get(&conf->size, sk + i * (conf->size.nb + conf->iat.nb), conf->q[j]));
+	}
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < conf->nq; j++)
+			fc_val("%.3f", sketch_get(&conf->iat, sk + i * (conf->size.nb + conf->iat.nb) + conf->size.nb,
+				conf->q[j]) / 1000.);
+	}
 }
 
 struct module module = {
 	.size = sizeof(struct flow),
+	.init = init,
 	.header = header,
 	.pkt  = pkt,
+	.uses = FC_USES_HEADERS,
 	.flow = flow
 };
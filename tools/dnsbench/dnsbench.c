@@ -0,0 +1,376 @@
+/*
+ * dnsbench - benchmark and fuzz driver for the dns module response parser
+ *
+ * Builds the dns module into a standalone program and feeds it synthetic DNS responses through its
+ * init() and pkt() functions, the same way flowcalc does. See README.
+ *
+ * Copyright (c) 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Licensed under GNU GPL v. 3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#ifndef DNS_C
+#define DNS_C "../../dns.c"
+#endif
+#include DNS_C
+
+/** Number of distinct messages generated for the benchmark */
+#define BENCH_POOL 65536
+
+/** Max. message size, incl. the 2-byte TCP length prefix */
+#define MSG_MAX 512
+
+struct msg {
+	uint8_t buf[MSG_MAX];          /**> 2-byte length prefix (DNS over TCP) + message */
+	int len;                       /**> message length, without the prefix */
+	char qname[64];                /**> queried name */
+	uint32_t addrs[4];             /**> A records (network byte order) */
+	int naddrs;                    /**> number of A records */
+};
+
+struct bench {
+	struct lfc lfc;                /**> fake libflowcalc handle */
+	struct flowcalc fc;            /**> fake flowcalc options */
+	void *md;                      /**> dns module data */
+	double ts;                     /**> timestamp of last packet */
+	uint64_t rnd;                  /**> xorshift64 state */
+	int errors;                    /**> number of failed checks */
+};
+
+/* the dns module writes its output through these, nothing to do here */
+struct fc_str *fc_str_attr(const char *name) { return NULL; }
+void fc_str_header(struct fc_str *attr) {}
+void fc_str(struct fc_str *attr, const char *val) {}
+void fc_val(const char *fmt, ...) {}
+void fc_def(int n, const char *def) {}
+
+/*****/
+
+static uint32_t rnd(struct bench *b)
+{
+	b->rnd ^= b->rnd << 13;
+	b->rnd ^= b->rnd >> 7;
+	b->rnd ^= b->rnd << 17;
+	return b->rnd >> 32;
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+	p = put16(p, v >> 16);
+	return put16(p, v);
+}
+
+/** Write name as DNS labels */
+static uint8_t *put_name(uint8_t *p, const char *name)
+{
+	const char *dot;
+	int n;
+
+	while (*name) {
+		dot = strchr(name, '.');
+		n = dot ? dot - name : strlen(name);
+		*p++ = n;
+		memcpy(p, name, n);
+		p += n;
+		name += n + (dot ? 1 : 0);
+	}
+
+	*p++ = 0;
+	return p;
+}
+
+/** Generate a response with 1-4 A records, half of them behind a CNAME */
+static void msg_make(struct bench *b, struct msg *m)
+{
+	uint8_t *start = m->buf + 2, *p;
+	uint16_t target = 12;
+	int i;
+	char cname[64];
+
+	snprintf(m->qname, sizeof m->qname, "host%u.example%u.com", rnd(b) % 100000, rnd(b) % 100);
+	m->naddrs = 1 + rnd(b) % 4;
+	bool alias = rnd(b) % 2;
+
+	p = put16(start, rnd(b));                        /* id */
+	p = put16(p, 0x8180);                            /* standard response, no error */
+	p = put16(p, 1);                                 /* qdcount */
+	p = put16(p, m->naddrs + alias);                 /* ancount */
+	p = put32(p, 0);                                 /* nscount, arcount */
+
+	p = put_name(p, m->qname);
+	p = put16(p, 1);                                 /* type A */
+	p = put16(p, 1);                                 /* class IN */
+
+	if (alias) {
+		snprintf(cname, sizeof cname, "edge%u.cdn.net", rnd(b) % 1000);
+
+		p = put16(p, 0xc000 | 12);
+		p = put16(p, 5);                             /* type CNAME */
+		p = put16(p, 1);
+		p = put32(p, 60 + rnd(b) % 3600);
+		p = put16(p, strlen(cname) + 2);
+		target = p - start;
+		p = put_name(p, cname);
+	}
+
+	for (i = 0; i < m->naddrs; i++) {
+		m->addrs[i] = htonl(0x5d000000 | (rnd(b) & 0xffffff));
+
+		p = put16(p, 0xc000 | target);
+		p = put16(p, 1);
+		p = put16(p, 1);
+		p = put32(p, 60 + rnd(b) % 3600);
+		p = put16(p, 4);
+		memcpy(p, &m->addrs[i], 4);
+		p += 4;
+	}
+
+	m->len = p - start;
+	put16(m->buf, m->len);
+}
+
+/** Damage a message: flip a few bytes or cut it short */
+static void msg_fuzz(struct bench *b, struct msg *m)
+{
+	int i, n;
+
+	if (rnd(b) % 2) {
+		n = 1 + rnd(b) % 4;
+		for (i = 0; i < n; i++)
+			m->buf[2 + rnd(b) % m->len] = rnd(b);
+	} else {
+		m->len = rnd(b) % m->len;
+	}
+
+	m->naddrs = 0;
+}
+
+/*****/
+
+/** Feed one packet from server 192.0.2.53:53 to client through pkt() */
+static void feed(struct bench *b, struct flowdata *fd, uint32_t client, bool tcp, bool first,
+	const uint8_t *data, int len)
+{
+	struct lfc_flow lf;
+	struct lfc_pkt lp;
+	libtrace_ip_t ip4;
+	libtrace_tcp_t th;
+	libtrace_udp_t uh;
+
+	memset(&lf, 0, sizeof lf);
+	lf.proto = tcp ? IPPROTO_TCP : IPPROTO_UDP;
+	lf.src.addr.ip4.s_addr = htonl(0xc0000235);
+	lf.src.port = 53;
+	lf.dst.addr.ip4.s_addr = client;
+	lf.dst.port = 1024 + client % 60000;
+
+	memset(&ip4, 0, sizeof ip4);
+	ip4.ip_src = lf.src.addr.ip4;
+	ip4.ip_dst = lf.dst.addr.ip4;
+
+	memset(&lp, 0, sizeof lp);
+	lp.ts = b->ts;
+	lp.first = first;
+	lp.ip4 = &ip4;
+	if (tcp)
+		lp.tcp = &th;
+	else
+		lp.udp = &uh;
+	lp.sport = 53;
+	lp.dport = lf.dst.port;
+	lp.data = (void *) data;
+	lp.len = len;
+
+	pkt(&b->lfc, b->md, &lf, &lp, fd);
+}
+
+/** feed() a copy of exactly len bytes, so that reads past the end are caught by ASan */
+static void feed_copy(struct bench *b, struct flowdata *fd, uint32_t client, bool tcp, bool first,
+	const uint8_t *data, int len)
+{
+	uint8_t *copy;
+
+	copy = malloc(len ? len : 1);
+	memcpy(copy, data, len);
+	feed(b, fd, client, tcp, first, copy, len);
+	free(copy);
+}
+
+/** Check that every A record of m is bound to its queried name */
+static void verify(struct bench *b, struct msg *m, uint32_t client, const char *what, int arg)
+{
+	union addr c, s;
+	const char *name;
+	int i;
+
+	addr_set4(&c, &client);
+	for (i = 0; i < m->naddrs; i++) {
+		addr_set4(&s, &m->addrs[i]);
+		name = find_name(b->md, &c, &s, b->ts);
+
+		if (!name || !streq(name, m->qname)) {
+			fprintf(stderr, "FAIL %s %d: %s: got %s\n", what, arg, m->qname, name ? name : "(none)");
+			b->errors++;
+			return;
+		}
+	}
+}
+
+/*****/
+
+static void bench_init(struct bench *b, uint64_t seed)
+{
+	memset(b, 0, sizeof *b);
+	b->lfc.mm = mmatic_create();
+	b->fc.mm = b->lfc.mm;
+	b->fc.opts = thash_create_strkey(NULL, b->lfc.mm);
+	b->ts = 1400000000.0;
+	b->rnd = seed ? seed : 1;
+
+	if (!init(&b->lfc, &b->md, &b->fc))
+		die("dns module init() failed\n");
+}
+
+/** Every truncation length, TCP streams split at every offset, a pointer loop */
+static int checks(uint64_t seed, int n)
+{
+	struct bench b;
+	struct msg m, m2, loop;
+	struct flowdata fd;
+	uint8_t two[2 * MSG_MAX];
+	uint32_t client = 0;
+	int i, len, off, twolen;
+
+	bench_init(&b, seed);
+
+	for (i = 0; i < n; i++) {
+		msg_make(&b, &m);
+		msg_make(&b, &m2);
+
+		/* truncated: must not crash nor read past the end (run under ASan) */
+		for (len = 0; len < m.len; len++) {
+			memset(&fd, 0, sizeof fd);
+			feed_copy(&b, &fd, htonl(0x0a000000 | ++client), false, true, m.buf + 2, len);
+		}
+
+		/* complete over UDP */
+		memset(&fd, 0, sizeof fd);
+		feed_copy(&b, &fd, htonl(0x0a000000 | ++client), false, true, m.buf + 2, m.len);
+		verify(&b, &m, htonl(0x0a000000 | client), "udp", m.len);
+
+		/* two messages in one TCP stream, split in 2 segments at every offset */
+		twolen = m.len + 2 + m2.len + 2;
+		memcpy(two, m.buf, m.len + 2);
+		memcpy(two + m.len + 2, m2.buf, m2.len + 2);
+		for (off = 0; off <= twolen; off++) {
+			memset(&fd, 0, sizeof fd);
+			feed_copy(&b, &fd, htonl(0x0b000000 | ++client), true, true, two, off);
+			feed_copy(&b, &fd, htonl(0x0b000000 | client), true, false, two + off, twolen - off);
+			verify(&b, &m, htonl(0x0b000000 | client), "tcp split", off);
+			verify(&b, &m2, htonl(0x0b000000 | client), "tcp split", off);
+		}
+	}
+
+	/* the queried name and the answer owner point to themselves */
+	memset(&loop, 0, sizeof loop);
+	uint8_t *p = loop.buf + 2;
+	p = put16(p, 1);
+	p = put16(p, 0x8180);
+	p = put16(p, 1);
+	p = put16(p, 1);
+	p = put32(p, 0);
+	p = put16(p, 0xc000 | 12);
+	p = put16(p, 1);
+	p = put16(p, 1);
+	p = put16(p, 0xc000 | 22);
+	p = put16(p, 1);
+	p = put16(p, 1);
+	p = put32(p, 60);
+	p = put16(p, 4);
+	p = put32(p, 0x5d000001);
+	loop.len = p - (loop.buf + 2);
+	memset(&fd, 0, sizeof fd);
+	feed_copy(&b, &fd, htonl(0x0c000001), false, true, loop.buf + 2, loop.len);
+
+	printf("checks: %d messages, %d errors\n", n, b.errors);
+	return b.errors;
+}
+
+/** Time n messages from a pool of synthetic ones, fuzzed with given probability [%] */
+static void bench(uint64_t seed, int n, int fuzz)
+{
+	struct bench b;
+	struct msg *pool;
+	struct flowdata fd;
+	struct timespec t0, t1;
+	double ns;
+	int i;
+
+	bench_init(&b, seed);
+
+	pool = malloc(BENCH_POOL * sizeof *pool);
+	for (i = 0; i < BENCH_POOL; i++) {
+		msg_make(&b, &pool[i]);
+		if ((int) (rnd(&b) % 100) < fuzz)
+			msg_fuzz(&b, &pool[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		struct msg *m = &pool[i % BENCH_POOL];
+
+		b.ts += 0.001;
+		memset(&fd, 0, sizeof fd);
+		feed(&b, &fd, htonl(0x0a000000 | (i & 0xffffff)), false, true, m->buf + 2, m->len);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	printf("bench: %d messages, %d%% fuzzed: %.0f ns/msg\n", n, fuzz, ns / n);
+
+	free(pool);
+}
+
+static void usage(void)
+{
+	printf("Usage: dnsbench [OPTIONS]\n");
+	printf("\n");
+	printf("  -n <num>     number of messages to time [4000000]\n");
+	printf("  -f <pct>     percent of fuzzed messages [10]\n");
+	printf("  -c <num>     do not time, run the checks on num messages\n");
+	printf("  -s <seed>    random seed [1]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int n = 4000000, fuzz = 10, c = 0, i;
+	uint64_t seed = 1;
+
+	while ((i = getopt(argc, argv, "n:f:c:s:h")) != -1) {
+		switch (i) {
+			case 'n': n = atoi(optarg); break;
+			case 'f': fuzz = atoi(optarg); break;
+			case 'c': c = atoi(optarg); break;
+			case 's': seed = strtoull(optarg, NULL, 10); break;
+			default: usage(); return 1;
+		}
+	}
+
+	if (c > 0)
+		return checks(seed, c) ? 1 : 0;
+
+	bench(seed, n, fuzz);
+	return 0;
+}
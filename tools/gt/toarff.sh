@@ -1,3 +1,3 @@
 #!/bin/bash
 
-flowcalc -e counters,basic,pktsize,dns,lpi,coral "$@"
+flowcalc -e counters,basic,pktsize,dns,lpi,coral -o lpi_fix=1 "$@"
@@ -0,0 +1,27 @@
+#!/bin/bash
+# Compare lpi results with and without the early stop (-o lpi_full=1) on given traces
+
+if [ $# -eq 0 ]; then
+	echo "Usage: lpicheck.sh <TRACE FILE>..." >&2
+	exit 1
+fi
+
+FLOWCALC="${FLOWCALC:-flowcalc}"
+full=$(mktemp)
+fast=$(mktemp)
+trap 'rm -f "$full" "$fast"' EXIT
+
+rc=0
+for trace in "$@"; do
+	"$FLOWCALC" -H -e lpi -o lpi_full=1 "$trace" > "$full" || exit 2
+	"$FLOWCALC" -H -e lpi "$trace" > "$fast" || exit 2
+
+	if cmp -s "$full" "$fast"; then
+		echo "$trace: identical, $(wc -l < "$full") flows"
+	else
+		echo "$trace: DIFFERENT, $(diff "$full" "$fast" | grep -c '^<') of $(wc -l < "$full") flows"
+		rc=1
+	fi
+done
+
+exit $rc
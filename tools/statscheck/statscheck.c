@@ -0,0 +1,202 @@
+/*
+ * statscheck - check the stats module moments against a two-pass reference
+ *
+ * Builds the stats module into a standalone program, feeds synthetic flows to moments_add() and
+ * compares moments_finish() with a two-pass long double computation. See README.
+ *
+ * Copyright (c) 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Licensed under GNU GPL v. 3
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "../../stats.c"
+
+/** Max. number of values in a flow */
+#define FLOW_MAX 100000
+
+/* the stats module writes its output through these, not used here */
+void fc_val(const char *fmt, ...) {}
+void fc_def(int n, const char *def) {}
+int64_t fc_ts(struct lfc_pkt *pkt) { return 0; }
+
+/*****/
+
+static uint64_t rnd_state = 1;
+
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state >> 32;
+}
+
+/** Generate n values of flow number i: each kind of flow in turn */
+static void flow_make(int i, uint64_t *v, int n)
+{
+	int j;
+
+	for (j = 0; j < n; j++) {
+		switch (i % 6) {
+			case 0: /* payload sizes */
+				v[j] = rnd() % 1461;
+				break;
+			case 1: /* near-constant full-size segments */
+				v[j] = (rnd() % 100) ? 1460 : 1448 + rnd() % 12;
+				break;
+			case 2: /* bulk IATs [ns]: about 1 ms */
+				v[j] = 1000000 + rnd() % 20000;
+				break;
+			case 3: /* hour-long IATs, 1 us jitter */
+				v[j] = 3600000000000ULL + rnd() % 1000;
+				break;
+			case 4: /* IATs spanning 1 us to 1 hour */
+				v[j] = (uint64_t) (1000 * pow(3.6e9, (rnd() / (double) UINT32_MAX)));
+				break;
+			case 5: /* constant */
+				v[j] = 1460;
+				break;
+		}
+	}
+}
+
+/** Two-pass reference: mean, then sum of squared deviations */
+static void reference(const uint64_t *v, int n, long double *mean, long double *std)
+{
+	long double sum = 0, m2 = 0;
+	int j;
+
+	for (j = 0; j < n; j++)
+		sum += v[j];
+	*mean = n ? sum / n : 0;
+
+	for (j = 0; j < n; j++)
+		m2 += (v[j] - *mean) * (v[j] - *mean);
+	*std = n > 1 ? sqrtl(m2 / (n - 1)) : 0;
+}
+
+static double relerr(double val, long double ref)
+{
+	if (ref == 0)
+		return fabs(val);
+	return fabsl((val - ref) / ref);
+}
+
+/*****/
+
+/** Check moments of nflows synthetic flows, finalized in batches of given size */
+static int check(int nflows, int batch)
+{
+	struct moments *m;
+	uint64_t *v;
+	long double *rmean, *rstd;
+	double *mean, *std, err, err_mean = 0, err_std = 0;
+	int i, j, *nv;
+
+	m = calloc(nflows, sizeof *m);
+	nv = calloc(nflows, sizeof *nv);
+	rmean = calloc(nflows, sizeof *rmean);
+	rstd = calloc(nflows, sizeof *rstd);
+	mean = calloc(nflows, sizeof *mean);
+	std = calloc(nflows, sizeof *std);
+	v = malloc(FLOW_MAX * sizeof *v);
+
+	for (i = 0; i < nflows; i++) {
+		/* lengths from 0 to FLOW_MAX, most of them short */
+		nv[i] = (i % 10 == 0) ? rnd() % FLOW_MAX : rnd() % 100;
+
+		flow_make(i, v, nv[i]);
+		for (j = 0; j < nv[i]; j++)
+			moments_add(&m[i], v[j]);
+
+		reference(v, nv[i], &rmean[i], &rstd[i]);
+	}
+
+	for (i = 0; i < nflows; i += batch)
+		moments_finish(m + i, MIN(batch, nflows - i), mean + i, std + i);
+
+	for (i = 0; i < nflows; i++) {
+		err = relerr(mean[i], rmean[i]);
+		if (err > err_mean) err_mean = err;
+
+		err = relerr(std[i], rstd[i]);
+		if (err > err_std) err_std = err;
+	}
+
+	printf("check: %d flows, batches of %d: max. relative error: mean %.2g, std %.2g\n",
+		nflows, batch, err_mean, err_std);
+
+	free(m); free(nv); free(rmean); free(rstd); free(mean); free(std); free(v);
+	return (err_mean > 1e-12 || err_std > 1e-12);
+}
+
+/** Time the per-value update: the old floating-point kernel and moments_add() */
+static void bench(int n)
+{
+	struct timespec t0, t1, t2;
+	struct moments m = { 0 };
+	uint64_t *v;
+	double mean = 0, var = 0, x, k;
+	int i;
+
+	v = malloc(n * sizeof *v);
+	for (i = 0; i < n; i++)
+		v[i] = rnd() % 1461;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		k = i + 1;
+		x = v[i];
+		if (k > 1)
+			var = (k-2)/(k-1)*var + 1/k*pow(x - mean, 2.);
+		mean = (x + (k-1)*mean) / k;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < n; i++)
+		moments_add(&m, v[i]);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	printf("bench: %d values: old %.2f ns/value, moments_add() %.2f ns/value (%g %g %g)\n", n,
+		((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / n,
+		((t2.tv_sec - t1.tv_sec) * 1e9 + (t2.tv_nsec - t1.tv_nsec)) / n,
+		mean, var, (double) m.sum);
+
+	free(v);
+}
+
+static void usage(void)
+{
+	printf("Usage: statscheck [OPTIONS]\n");
+	printf("\n");
+	printf("  -n <num>     number of flows to check [2000]\n");
+	printf("  -b <num>     number of values to time [100000000]\n");
+	printf("  -s <seed>    random seed [1]\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int nflows = 2000, nbench = 100000000, rc = 0, i;
+
+	while ((i = getopt(argc, argv, "n:b:s:h")) != -1) {
+		switch (i) {
+			case 'n': nflows = atoi(optarg); break;
+			case 'b': nbench = atoi(optarg); break;
+			case 's': rnd_state = strtoull(optarg, NULL, 10) ? : 1; break;
+			default: usage(); return 1;
+		}
+	}
+
+	/* as in flow(), then over many flows at once (NB: moments_finish() uses the stack) */
+	rc |= check(nflows, 4);
+	rc |= check(nflows, 1024);
+
+	if (nbench > 0)
+		bench(nbench);
+
+	return rc;
+}
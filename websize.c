@@ -103,13 +103,16 @@ void flow(struct lfc *lfc, void *pdata,
 	struct flow *f = data;
 	int i;
 
-	for (i = 0; i < N(f->up.size); i++) printf(",%d", f->up.size[i]);
-	for (i = 0; i < N(f->up.size); i++) printf(",%d", f->down.size[i]);
+	for (i = 0; i < f->up.cnt; i++) fc_val("%d", f->up.size[i]);
+	fc_def(N(f->up.size) - f->up.cnt, "0");
+	for (i = 0; i < f->down.cnt; i++) fc_val("%d", f->down.size[i]);
+	fc_def(N(f->down.size) - f->down.cnt, "0");
 }
 
 struct module module = {
 	.size = sizeof(struct flow),
 	.header = header,
 	.pkt  = pkt,
+	.uses = FC_USES_PAYLOAD,
 	.flow = flow
 };
@@ -0,0 +1,870 @@
+/*
+ * zin: read-ahead and decompression of trace files on dedicated threads
+ *
+ * The reader thread reads the trace file into a ring of large buffers, giving the kernel read-ahead
+ * hints. The decoder thread decompresses them (gzip, xz, zstd) into a pipe, which is read by
+ * libtrace as an uncompressed trace. Thus I/O, decompression and flow computation overlap.
+ * Other files are passed as they are, so libtrace can still handle them by itself.
+ *
+ * Plain PCAP files skip the copying: the file is mmap()-ed and its pages are vmsplice()-d into the
+ * pipe, so the only copy left is the one made by libtrace reading the pipe.
+ *
+ * PCAP records can be rewritten on the way (see ZIN_TRIM etc.): if no module needs the payload,
+ * packets are trimmed to their headers, so libtrace copies and parses a fraction of the data (sizes
+ * are still known from the IP headers). Link headers such as VLAN, MPLS or PPPoE can be stripped,
+ * so that libtrace reads raw IP packets, optionally taken out of GRE and VXLAN tunnels.
+ *
+ * Copyright (c) 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Licensed under GNU GPL v. 3
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <zlib.h>
+#include <lzma.h>
+#ifndef NOZSTD
+#include <zstd.h>
+#endif
+
+#include "zin.h"
+
+/** Decompression state of the decoder thread */
+struct zstate {
+	z_stream gz;
+	lzma_stream xz;
+#ifndef NOZSTD
+	ZSTD_DCtx *zstd;
+	size_t zhint;           /**> last ZSTD_decompressStream() result: 0 = frame complete */
+#endif
+};
+
+static bool write_all(struct zin *z, const char *buf, size_t len)
+{
+	ssize_t rv;
+
+	while (len > 0) {
+		rv = write(z->wfd, buf, len);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return false; /* eg. EPIPE: libtrace is done */
+
+		buf += rv;
+		len -= rv;
+	}
+
+	return true;
+}
+
+/*
+ * Rewriting of PCAP records, see ZIN_TRIM etc.
+ */
+
+static uint32_t rd32(struct zin *z, const char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return z->swap ? __builtin_bswap32(v) : v;
+}
+
+static void wr32(struct zin *z, char *p, uint32_t v)
+{
+	if (z->swap) v = __builtin_bswap32(v);
+	memcpy(p, &v, 4);
+}
+
+/** Ethertype of a PPP protocol number */
+static uint32_t ppp_ethertype(uint32_t proto)
+{
+	switch (proto) {
+		case 0x0021: return 0x0800;
+		case 0x0057: return 0x86dd;
+		default:     return 0;
+	}
+}
+
+/** Skip VLAN, MPLS and PPPoE headers
+ * @param off       start of data of given ethertype
+ * @return          offset of IP header, or -1 if not IP */
+static int skip_ether(const uint8_t *p, uint32_t caplen, uint32_t off, uint32_t type)
+{
+	for (;;) {
+		switch (type) {
+			case 0x0800:
+			case 0x86dd:
+				return off;
+			case 0x8100: /* VLAN */
+			case 0x88a8:
+			case 0x9100:
+				if (off + 4 > caplen) return -1;
+				type = p[off + 2] << 8 | p[off + 3];
+				off += 4;
+				break;
+			case 0x8847: /* MPLS: labels until bottom of stack, then IP is assumed */
+			case 0x8848:
+				do {
+					if (off + 4 > caplen) return -1;
+					off += 4;
+				} while (!(p[off - 2] & 0x01));
+				return off;
+			case 0x8864: /* PPPoE session */
+				if (off + 8 > caplen) return -1;
+				type = ppp_ethertype(p[off + 6] << 8 | p[off + 7]);
+				off += 8;
+				break;
+			default:
+				return -1;
+		}
+	}
+}
+
+/** Check IP header at given offset
+ * @param proto     IP protocol, after IPv6 extension headers
+ * @return          offset of TCP/UDP header (-1 if none, eg. fragment), or -2 if not valid IP */
+static int check_ip(const uint8_t *p, uint32_t caplen, int ip, uint8_t *proto)
+{
+	int i;
+
+	if (ip < 0 || ip + 20 > caplen) return -2;
+
+	switch (p[ip] >> 4) {
+		case 4:
+			if ((p[ip] & 0x0f) < 5) return -2;
+			*proto = p[ip + 9];
+			if ((p[ip + 6] & 0x1f) || p[ip + 7]) return -1; /* not first fragment */
+			return ip + (p[ip] & 0x0f) * 4;
+		case 6:
+			if (ip + 40 > caplen) return -2;
+			*proto = p[ip + 6];
+			ip += 40;
+
+			/* skip extension headers, if captured */
+			for (i = 0; i < ZIN_IP6_MAXEXT; i++) {
+				switch (*proto) {
+					case 0:  /* hop-by-hop options */
+					case 43: /* routing */
+					case 60: /* destination options */
+						if (ip + 8 > caplen) return -1;
+						*proto = p[ip];
+						ip += (p[ip + 1] + 1) * 8;
+						break;
+					case 51: /* AH */
+						if (ip + 8 > caplen) return -1;
+						*proto = p[ip];
+						ip += (p[ip + 1] + 2) * 4;
+						break;
+					case 44: /* fragment */
+						if (ip + 8 > caplen) return -1;
+						*proto = p[ip];
+						if ((p[ip + 2] << 8 | p[ip + 3]) & 0xfff8) return -1; /* not first fragment */
+						ip += 8;
+						break;
+					default:
+						return ip;
+				}
+			}
+			return -1;
+		default:
+			return -2;
+	}
+}
+
+/** Check IPv4 header checksum, if captured */
+static bool csum_ok(const uint8_t *p, uint32_t caplen, int ip)
+{
+	uint32_t sum = 0, i, hl;
+
+	if (p[ip] >> 4 != 4) return true;
+
+	hl = (p[ip] & 0x0f) * 4;
+	if (ip + hl > caplen) return true;
+
+	for (i = 0; i < hl; i += 2)
+		sum += p[ip + i] << 8 | p[ip + i + 1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum == 0xffff;
+}
+
+/** Find IP header of a packet, skipping link headers and (with ZIN_TUNNEL) GRE and VXLAN
+ * @param l4        offset of TCP/UDP header, -1 if none
+ * @param proto     IP protocol
+ * @return          offset of IP header, -1 if not IP, -2 if bad checksum (with ZIN_CSUM) */
+static int find_ip(struct zin *z, const uint8_t *p, uint32_t caplen, int *l4, uint8_t *proto)
+{
+	int ip, in, inl4, depth;
+	uint32_t fl, n;
+	uint8_t inproto;
+
+	switch (z->linktype) {
+		case 1: /* Ethernet */
+			ip = caplen >= 14 ? skip_ether(p, caplen, 14, p[12] << 8 | p[13]) : -1;
+			break;
+		case 113: /* Linux SLL */
+			ip = caplen >= 16 ? skip_ether(p, caplen, 16, p[14] << 8 | p[15]) : -1;
+			break;
+		case 9: /* PPP, maybe in HDLC framing */
+		case 50:
+			n = (caplen >= 2 && p[0] == 0xff && p[1] == 0x03) ? 2 : 0;
+			ip = caplen >= n + 2 ? skip_ether(p, caplen, n + 2, ppp_ethertype(p[n] << 8 | p[n + 1])) : -1;
+			break;
+		case 0: /* BSD loopback */
+			ip = 4;
+			break;
+		default: /* raw IP */
+			ip = 0;
+			break;
+	}
+
+	*l4 = check_ip(p, caplen, ip, proto);
+	if (*l4 == -2) return -1;
+	if ((z->flags & ZIN_CSUM) && !csum_ok(p, caplen, ip)) return -2;
+
+	for (depth = 0; (z->flags & ZIN_TUNNEL) && *l4 >= 0 && depth < 4; depth++) {
+		if (*proto == 47 && *l4 + 4 <= caplen) {
+			/* GRE version 0: skip optional checksum, key and sequence number */
+			fl = p[*l4] << 8 | p[*l4 + 1];
+			if (fl & 0x0007) break;
+			n = *l4 + 4 + (fl & 0x8000 ? 4 : 0) + (fl & 0x2000 ? 4 : 0) + (fl & 0x1000 ? 4 : 0);
+
+			if ((p[*l4 + 2] << 8 | p[*l4 + 3]) == 0x6558) /* transparent Ethernet bridging */
+				in = n + 14 <= caplen ? skip_ether(p, caplen, n + 14, p[n + 12] << 8 | p[n + 13]) : -1;
+			else
+				in = skip_ether(p, caplen, n, p[*l4 + 2] << 8 | p[*l4 + 3]);
+		} else if (*proto == 17 && *l4 + 30 <= caplen && (p[*l4 + 2] << 8 | p[*l4 + 3]) == 4789) {
+			/* VXLAN: UDP, VXLAN and inner Ethernet headers */
+			n = *l4 + 16;
+			in = skip_ether(p, caplen, n + 14, p[n + 12] << 8 | p[n + 13]);
+		} else {
+			break;
+		}
+
+		/* NB: keep the outer packet if the inner one is not valid IP */
+		inl4 = check_ip(p, caplen, in, &inproto);
+		if (inl4 == -2) break;
+		if ((z->flags & ZIN_CSUM) && !csum_ok(p, caplen, in)) return -2;
+
+		ip = in;
+		*l4 = inl4;
+		*proto = inproto;
+	}
+
+	return ip;
+}
+
+/** End of TCP/UDP header, or caplen if not sure */
+static uint32_t l4_end(const uint8_t *p, uint32_t caplen, int l4, uint8_t proto)
+{
+	if (l4 < 0) return caplen;
+
+	switch (proto) {
+		case 6:
+			if (l4 + 20 > caplen) return caplen;
+			return MIN(l4 + (p[l4 + 12] >> 4) * 4, caplen);
+		case 17:
+			return MIN(l4 + 8, caplen);
+		default:
+			return caplen;
+	}
+}
+
+static bool obuf_flush(struct zin *z)
+{
+	bool ok = write_all(z, z->obuf, z->olen);
+
+	z->olen = 0;
+	return ok;
+}
+
+/** Rewrite PCAP global header */
+static bool rewrite_hdr(struct zin *z, const char *h)
+{
+	uint8_t m[4];
+
+	memcpy(m, h, 4);
+	if (memcmp(m, "\xd4\xc3\xb2\xa1", 4) && memcmp(m, "\xa1\xb2\xc3\xd4", 4) &&
+	    memcmp(m, "\x4d\x3c\xb2\xa1", 4) && memcmp(m, "\xa1\xb2\x3c\x4d", 4)) {
+		dbg(z->flags & ~ZIN_TRIM ? 0 : 1, "zin: not a PCAP file, packets not rewritten\n");
+		z->passthru = true;
+		return write_all(z, h, ZIN_PCAP_HDR);
+	}
+
+	/* big endian? */
+	z->swap = (m[0] == 0xa1);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	z->swap = !z->swap;
+#endif
+
+	z->linktype = rd32(z, h + 20);
+	switch (z->linktype) {
+		case 0: case 1: case 9: case 50: case 113:
+		case 12: case 101: case 228: case 229: /* raw IP */
+			break;
+		default:
+			dbg(z->flags & ~ZIN_TRIM ? 0 : 1, "zin: PCAP link type %u not supported, packets not rewritten\n",
+				z->linktype);
+			z->passthru = true;
+			return write_all(z, h, ZIN_PCAP_HDR);
+	}
+
+	memcpy(z->obuf, h, ZIN_PCAP_HDR);
+	if (z->flags & ZIN_DECAP)
+		wr32(z, z->obuf + 20, 101); /* LINKTYPE_RAW */
+	z->olen = ZIN_PCAP_HDR;
+	z->gothdr = true;
+
+	return true;
+}
+
+/** Rewrite PCAP record */
+static bool rewrite_rec(struct zin *z, const char *r, uint32_t caplen)
+{
+	const uint8_t *p = (const uint8_t *) r + ZIN_PCAP_REC;
+	uint32_t off = 0, end = caplen, orig;
+	int ip, l4;
+	uint8_t proto = 0;
+
+	ip = find_ip(z, p, caplen, &l4, &proto);
+
+	/* drop? */
+	if (ip == -2 || ((z->flags & ZIN_DECAP) && (ip < 0 || (proto != 6 && proto != 17)))) {
+		z->dropped++;
+		return true;
+	}
+
+	if (ip >= 0 && (z->flags & ZIN_DECAP))
+		off = ip;
+	if (ip >= 0 && (z->flags & ZIN_TRIM))
+		end = l4_end(p, caplen, l4, proto);
+	z->trimmed += caplen - (end - off);
+
+	if (z->olen + ZIN_PCAP_REC + end - off > ZIN_OUTBUF && !obuf_flush(z))
+		return false;
+
+	/* NB: timestamps stay, so does the original length of what is left */
+	orig = rd32(z, r + 12);
+	memcpy(z->obuf + z->olen, r, 8);
+	wr32(z, z->obuf + z->olen + 8, end - off);
+	wr32(z, z->obuf + z->olen + 12, orig > off ? orig - off : end - off);
+	memcpy(z->obuf + z->olen + ZIN_PCAP_REC, p + off, end - off);
+	z->olen += ZIN_PCAP_REC + end - off;
+
+	return true;
+}
+
+/** Length of next PCAP header or record
+ * @return          0 if not known yet, SIZE_MAX if invalid */
+static size_t unit_len(struct zin *z, const char *p, size_t len)
+{
+	uint32_t caplen;
+
+	if (!z->gothdr) return ZIN_PCAP_HDR;
+	if (len < ZIN_PCAP_REC) return 0;
+
+	caplen = rd32(z, p + 8);
+	if (caplen > ZIN_PCAP_MAXCAP) return SIZE_MAX;
+
+	return ZIN_PCAP_REC + caplen;
+}
+
+static bool rewrite_unit(struct zin *z, const char *p, size_t len)
+{
+	if (!z->gothdr)
+		return rewrite_hdr(z, p);
+	else
+		return rewrite_rec(z, p, len - ZIN_PCAP_REC);
+}
+
+/** Write next piece of PCAP data to the pipe, rewriting records as in z->flags */
+static bool emit(struct zin *z, const char *data, size_t len)
+{
+	size_t need, n;
+
+	if (!z->flags)
+		return write_all(z, data, len);
+
+	while (len > 0 && !z->passthru) {
+		/* whole units straight from data */
+		if (z->partlen == 0) {
+			need = unit_len(z, data, len);
+			if (need > 0 && need <= len) {
+				if (!rewrite_unit(z, data, need))
+					return false;
+				data += need;
+				len -= need;
+				continue;
+			}
+		}
+
+		/* collect a unit split between pieces */
+		need = unit_len(z, z->part, z->partlen);
+		if (need == SIZE_MAX) {
+			dbg(0, "zin: invalid PCAP record, passing the rest as it is\n");
+			z->passthru = true;
+			break;
+		}
+		if (need == 0)
+			need = ZIN_PCAP_REC;
+
+		n = MIN(need - z->partlen, len);
+		memcpy(z->part + z->partlen, data, n);
+		z->partlen += n;
+		data += n;
+		len -= n;
+
+		if (unit_len(z, z->part, z->partlen) == z->partlen) {
+			if (!rewrite_unit(z, z->part, z->partlen))
+				return false;
+			z->partlen = 0;
+		}
+	}
+
+	if (z->passthru) {
+		if (!obuf_flush(z) || !write_all(z, z->part, z->partlen))
+			return false;
+		z->partlen = 0;
+		return write_all(z, data, len);
+	}
+
+	return true;
+}
+
+/** Flush rewritten records at the end of data, pass an incomplete last one as it is */
+static bool emit_end(struct zin *z)
+{
+	bool ok;
+
+	if (!z->flags)
+		return true;
+
+	ok = obuf_flush(z) && write_all(z, z->part, z->partlen);
+	z->partlen = 0;
+	return ok;
+}
+
+static bool state_init(struct zin *z, struct zstate *st)
+{
+	lzma_stream init = LZMA_STREAM_INIT;
+
+	memset(st, 0, sizeof *st);
+
+	switch (z->type) {
+		case ZIN_GZIP:
+			return inflateInit2(&st->gz, 15 + 16) == Z_OK;
+		case ZIN_XZ:
+			st->xz = init;
+			return lzma_stream_decoder(&st->xz, UINT64_MAX, LZMA_CONCATENATED) == LZMA_OK;
+#ifndef NOZSTD
+		case ZIN_ZSTD:
+			st->zstd = ZSTD_createDCtx();
+			return st->zstd != NULL;
+#endif
+		default:
+			return true;
+	}
+}
+
+static void state_free(struct zin *z, struct zstate *st)
+{
+	switch (z->type) {
+		case ZIN_GZIP:
+			inflateEnd(&st->gz);
+			break;
+		case ZIN_XZ:
+			lzma_end(&st->xz);
+			break;
+#ifndef NOZSTD
+		case ZIN_ZSTD:
+			ZSTD_freeDCtx(st->zstd);
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+/** Decompress next piece of file into the pipe
+ * @param last      end of file: len is 0 */
+static bool decode(struct zin *z, struct zstate *st, char *out, const char *data, size_t len, bool last)
+{
+	int rv;
+	lzma_ret lrv;
+#ifndef NOZSTD
+	ZSTD_inBuffer zi = { data, len, 0 };
+	ZSTD_outBuffer zo = { out, ZIN_OUTBUF, 0 };
+#endif
+
+	switch (z->type) {
+		case ZIN_GZIP:
+			st->gz.next_in = (Bytef *) data;
+			st->gz.avail_in = len;
+			do {
+				st->gz.next_out = (Bytef *) out;
+				st->gz.avail_out = ZIN_OUTBUF;
+
+				rv = inflate(&st->gz, Z_NO_FLUSH);
+				if (rv == Z_STREAM_END)
+					inflateReset(&st->gz); /* next gzip member? */
+				else if (rv == Z_BUF_ERROR)
+					break; /* need more input */
+				else if (rv != Z_OK)
+					return false;
+
+				if (!emit(z, out, ZIN_OUTBUF - st->gz.avail_out))
+					return false;
+			} while (st->gz.avail_in > 0 || st->gz.avail_out == 0);
+
+			/* at the end, no gzip member may be left unfinished */
+			return !last || st->gz.total_in == 0;
+
+		case ZIN_XZ:
+			st->xz.next_in = (const uint8_t *) data;
+			st->xz.avail_in = len;
+			do {
+				st->xz.next_out = (uint8_t *) out;
+				st->xz.avail_out = ZIN_OUTBUF;
+
+				lrv = lzma_code(&st->xz, last ? LZMA_FINISH : LZMA_RUN);
+				if (lrv != LZMA_OK && lrv != LZMA_STREAM_END)
+					return false;
+
+				if (!emit(z, out, ZIN_OUTBUF - st->xz.avail_out))
+					return false;
+
+				if (lrv == LZMA_STREAM_END)
+					break;
+			} while (st->xz.avail_in > 0 || st->xz.avail_out == 0 || last);
+			return true;
+
+#ifndef NOZSTD
+		case ZIN_ZSTD:
+			/* at the end, no zstd frame may be left unfinished */
+			if (last)
+				return st->zhint == 0;
+
+			do {
+				zo.pos = 0;
+				st->zhint = ZSTD_decompressStream(st->zstd, &zo, &zi);
+				if (ZSTD_isError(st->zhint))
+					return false;
+
+				if (!emit(z, out, zo.pos))
+					return false;
+			} while (zi.pos < zi.size || zo.pos == zo.size);
+			return true;
+#endif
+
+		default:
+			return emit(z, data, len);
+	}
+}
+
+static void *reader(void *arg)
+{
+	struct zin *z = arg;
+	struct zbuf *b;
+	off_t off = 0;
+	ssize_t rv = 0;
+	bool eof = false;
+
+	while (!eof) {
+		/* wait for a free buffer */
+		pthread_mutex_lock(&z->lock);
+		while (z->next_in - z->next_out >= ZIN_RING && !z->stop)
+			pthread_cond_wait(&z->cond, &z->lock);
+
+		if (z->stop) {
+			pthread_mutex_unlock(&z->lock);
+			break;
+		}
+
+		b = &z->ring[z->next_in % ZIN_RING];
+		pthread_mutex_unlock(&z->lock);
+
+		/* ask the kernel to read the next buffer in the background */
+		posix_fadvise(z->fd, off + ZIN_CHUNK, ZIN_CHUNK, POSIX_FADV_WILLNEED);
+
+		/* fill it */
+		b->len = 0;
+		while (b->len < ZIN_CHUNK) {
+			rv = read(z->fd, b->data + b->len, ZIN_CHUNK - b->len);
+			if (rv < 0 && errno == EINTR)
+				continue;
+			if (rv < 0)
+				dbg(0, "zin: read failed: %m\n");
+			if (rv <= 0) {
+				eof = true;
+				break;
+			}
+			b->len += rv;
+		}
+		off += b->len;
+
+		pthread_mutex_lock(&z->lock);
+		if (b->len > 0)
+			z->next_in++;
+		if (rv < 0)
+			z->error = true;
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+	}
+
+	pthread_mutex_lock(&z->lock);
+	z->eof = true;
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+
+	return NULL;
+}
+
+/** libtrace may close the pipe before the end: just get EPIPE then */
+static void block_sigpipe(void)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+/** Stop after writing to the pipe, tell libtrace it is the end */
+static void pipe_done(struct zin *z, bool ok)
+{
+	/* NB: if stopped by zin_finish(), EPIPE is not an error */
+	pthread_mutex_lock(&z->lock);
+	if (!ok && !z->stop) {
+		dbg(0, "zin: reading trace file failed\n");
+		z->stop = true;
+		z->error = true;
+	}
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+
+	/* EOF for libtrace */
+	close(z->wfd);
+}
+
+static void *splicer(void *arg)
+{
+	struct zin *z = arg;
+	struct iovec iov;
+	size_t off, len;
+	ssize_t rv = 0;
+
+	block_sigpipe();
+
+	for (off = 0; off < z->maplen && rv >= 0; off += len) {
+		len = MIN(ZIN_CHUNK, z->maplen - off);
+
+		/* ask the kernel to read the next chunk in the background */
+		if (off + len < z->maplen)
+			madvise(z->map + off + len, MIN(ZIN_CHUNK, z->maplen - off - len), MADV_WILLNEED);
+
+		iov.iov_base = z->map + off;
+		iov.iov_len = len;
+		while (iov.iov_len > 0) {
+			rv = vmsplice(z->wfd, &iov, 1, 0);
+			if (rv < 0 && errno == EINTR)
+				continue;
+			if (rv <= 0) {
+				rv = -1;
+				break;
+			}
+			iov.iov_base = (char *) iov.iov_base + rv;
+			iov.iov_len -= rv;
+		}
+	}
+
+	pipe_done(z, rv >= 0);
+	return NULL;
+}
+
+static void *rewriter(void *arg)
+{
+	struct zin *z = arg;
+	size_t off, len;
+	bool ok = true;
+
+	block_sigpipe();
+
+	for (off = 0; off < z->maplen && ok; off += len) {
+		len = MIN(ZIN_CHUNK, z->maplen - off);
+
+		/* ask the kernel to read the next chunk in the background */
+		if (off + len < z->maplen)
+			madvise(z->map + off + len, MIN(ZIN_CHUNK, z->maplen - off - len), MADV_WILLNEED);
+
+		ok = emit(z, z->map + off, len);
+	}
+
+	pipe_done(z, ok && emit_end(z));
+	return NULL;
+}
+
+static void *decoder(void *arg)
+{
+	struct zin *z = arg;
+	struct zbuf *b;
+	struct zstate st;
+	char *out;
+	bool ok;
+
+	block_sigpipe();
+
+	out = malloc(ZIN_OUTBUF);
+	ok = out && state_init(z, &st);
+
+	while (ok) {
+		pthread_mutex_lock(&z->lock);
+		while (z->next_out == z->next_in && !z->eof)
+			pthread_cond_wait(&z->cond, &z->lock);
+
+		if (z->next_out == z->next_in) {
+			pthread_mutex_unlock(&z->lock);
+			ok = decode(z, &st, out, NULL, 0, true);
+			break;
+		}
+
+		b = &z->ring[z->next_out % ZIN_RING];
+		pthread_mutex_unlock(&z->lock);
+
+		ok = decode(z, &st, out, b->data, b->len, false);
+
+		pthread_mutex_lock(&z->lock);
+		z->next_out++;
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+	}
+
+	if (out) {
+		state_free(z, &st);
+		free(out);
+	}
+
+	pipe_done(z, ok && emit_end(z));
+	return NULL;
+}
+
+struct zin *zin_start(mmatic *mm, const char *file, int flags)
+{
+	struct zin *z;
+	struct stat st;
+	uint8_t m[6];
+	int i, p[2];
+
+	/* regular files only, not eg. libtrace URIs */
+	if (stat(file, &st) != 0 || !S_ISREG(st.st_mode))
+		return NULL;
+
+	z = mmatic_zalloc(mm, sizeof *z);
+
+	z->fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (z->fd < 0)
+		return NULL;
+	posix_fadvise(z->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	/* detect compression by magic number */
+	memset(m, 0, sizeof m);
+	if (pread(z->fd, m, sizeof m, 0) < 0) {
+		close(z->fd);
+		return NULL;
+	}
+
+	if (m[0] == 0x1f && m[1] == 0x8b)
+		z->type = ZIN_GZIP;
+	else if (memcmp(m, "\xfd" "7zXZ\0", 6) == 0)
+		z->type = ZIN_XZ;
+#ifndef NOZSTD
+	else if (m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd)
+		z->type = ZIN_ZSTD;
+#endif
+	else if (!memcmp(m, "\xd4\xc3\xb2\xa1", 4) || !memcmp(m, "\xa1\xb2\xc3\xd4", 4) ||
+	         !memcmp(m, "\x4d\x3c\xb2\xa1", 4) || !memcmp(m, "\xa1\xb2\x3c\x4d", 4))
+		z->type = ZIN_PCAP; /* PCAP or PCAP-ns, any byte order */
+	else
+		z->type = ZIN_RAW;
+
+	if (z->type == ZIN_PCAP) {
+		z->maplen = st.st_size;
+		z->map = mmap(NULL, z->maplen, PROT_READ, MAP_SHARED, z->fd, 0);
+		if (z->map == MAP_FAILED) {
+			z->map = NULL;
+			z->type = ZIN_RAW;
+		} else {
+			madvise(z->map, z->maplen, MADV_SEQUENTIAL);
+		}
+	}
+
+	/* rewrite PCAP records? */
+	z->flags = flags;
+	if (z->flags) {
+		z->obuf = mmatic_alloc(mm, ZIN_OUTBUF);
+		z->part = mmatic_alloc(mm, ZIN_PCAP_REC + ZIN_PCAP_MAXCAP);
+	}
+
+	if (pipe2(p, O_CLOEXEC) != 0) {
+		close(z->fd);
+		return NULL;
+	}
+	fcntl(p[1], F_SETPIPE_SZ, 1 << 20);
+
+	z->rfd = p[0];
+	z->wfd = p[1];
+	snprintf(z->path, sizeof z->path, "/dev/fd/%d", z->rfd);
+
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->cond, NULL);
+
+	if (z->map && z->flags) {
+		pthread_create(&z->decoder, NULL, rewriter, z);
+	} else if (z->map) {
+		pthread_create(&z->decoder, NULL, splicer, z);
+	} else {
+		for (i = 0; i < ZIN_RING; i++)
+			z->ring[i].data = mmatic_alloc(mm, ZIN_CHUNK);
+
+		pthread_create(&z->reader, NULL, reader, z);
+		pthread_create(&z->decoder, NULL, decoder, z);
+	}
+
+	dbg(1, "zin: reading %s on dedicated threads (type %d, flags 0x%x)\n", file, z->type, z->flags);
+	return z;
+}
+
+const char *zin_path(struct zin *z)
+{
+	return z->path;
+}
+
+bool zin_finish(struct zin *z)
+{
+	pthread_mutex_lock(&z->lock);
+	z->stop = true;
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+
+	/* libtrace is done: no more readers, the decoder gets EPIPE if not finished yet */
+	close(z->rfd);
+
+	pthread_join(z->decoder, NULL);
+	if (z->map)
+		munmap(z->map, z->maplen);
+	else
+		pthread_join(z->reader, NULL);
+	close(z->fd);
+
+	if (z->flags)
+		dbg(1, "zin: trimmed %lu bytes, dropped %lu packets\n",
+			(unsigned long) z->trimmed, (unsigned long) z->dropped);
+
+	return !z->error;
+}
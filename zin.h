@@ -0,0 +1,101 @@
+/*
+ * zin: read-ahead and decompression of trace files on dedicated threads
+ *
+ * Copyright (c) 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Licensed under GNU GPL v. 3
+ */
+
+#ifndef _ZIN_H_
+#define _ZIN_H_
+
+#include <pthread.h>
+#include <libpjf/lib.h>
+
+/** Size of input buffer */
+#define ZIN_CHUNK (4 << 20)
+
+/** Number of input buffers in ring */
+#define ZIN_RING 8
+
+/** Size of decompressed output buffer */
+#define ZIN_OUTBUF (1 << 20)
+
+/** PCAP global header and record header sizes */
+#define ZIN_PCAP_HDR 24
+#define ZIN_PCAP_REC 16
+
+/** Max. PCAP record data length */
+#define ZIN_PCAP_MAXCAP (256 << 10)
+
+/** Max. number of IPv6 extension headers to skip */
+#define ZIN_IP6_MAXEXT 8
+
+/** zin_start() flags: rewriting of PCAP packets before libtrace reads them */
+#define ZIN_TRIM   0x01     /**> trim packets to IP and TCP/UDP headers */
+#define ZIN_DECAP  0x02     /**> strip link headers (Ethernet, VLAN, MPLS, PPPoE...): raw IP only */
+#define ZIN_TUNNEL 0x04     /**> with ZIN_DECAP: take inner packets out of GRE and VXLAN */
+#define ZIN_CSUM   0x08     /**> drop IPv4 packets with bad header checksum */
+
+/** A buffer of file data */
+struct zbuf {
+	char *data;             /**> file data */
+	size_t len;             /**> data length */
+};
+
+struct zin {
+	enum zin_type {
+		ZIN_RAW = 1,        /**> uncompressed or not supported: just read ahead */
+		ZIN_PCAP,           /**> plain PCAP: mmap() and vmsplice() into the pipe */
+		ZIN_GZIP,
+		ZIN_XZ,
+		ZIN_ZSTD
+	} type;                 /**> compression method */
+
+	int fd;                 /**> trace file */
+	int rfd;                /**> read end of the pipe given to libtrace */
+	int wfd;                /**> write end of the pipe */
+	char path[32];          /**> rfd as file path */
+
+	char *map;              /**> ZIN_PCAP: file mmap() */
+	size_t maplen;          /**> ZIN_PCAP: file size */
+
+	int flags;              /**> ZIN_TRIM, ZIN_DECAP, etc. (0 = pass data as it is) */
+	bool gothdr;            /**> PCAP global header seen? */
+	bool passthru;          /**> not PCAP, unsupported or invalid: pass the rest as it is */
+	bool swap;              /**> PCAP in other byte order? */
+	uint32_t linktype;      /**> PCAP link type */
+	char *part;             /**> PCAP header or record split between pieces of data */
+	size_t partlen;         /**> length of part */
+	char *obuf;             /**> rewritten records */
+	size_t olen;            /**> length of obuf */
+	uint64_t trimmed;       /**> number of bytes trimmed or stripped */
+	uint64_t dropped;       /**> number of packets dropped */
+
+	struct zbuf ring[ZIN_RING]; /**> ring of input buffers */
+	uint64_t next_in;       /**> next buffer to read from file */
+	uint64_t next_out;      /**> next buffer to decompress */
+	bool eof;               /**> read everything? */
+	bool stop;              /**> stop reading, eg. on error */
+	bool error;             /**> read or decompression error? */
+
+	pthread_mutex_t lock;   /**> protects the above */
+	pthread_cond_t cond;    /**> signals any change of the above */
+
+	pthread_t reader;       /**> reads file into ring */
+	pthread_t decoder;      /**> decompresses ring into the pipe (or passes the mmap) */
+};
+
+/** Start reading a trace file on dedicated threads
+ * @param file      trace file path
+ * @param flags     ZIN_TRIM, ZIN_DECAP, etc.: rewrite PCAP packets (0 = none)
+ * @return          NULL if not a regular file or on error: then let libtrace read file directly */
+struct zin *zin_start(mmatic *mm, const char *file, int flags);
+
+/** File path that libtrace should read instead */
+const char *zin_path(struct zin *z);
+
+/** Stop reading and wait for threads
+ * @retval false    read or decompression error */
+bool zin_finish(struct zin *z);
+
+#endif
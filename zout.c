@@ -0,0 +1,323 @@
+/*
+ * zout: multi-threaded compression of standard output
+ *
+ * Standard output is redirected to a pipe. The reader thread cuts the pipe data into chunks, which
+ * are compressed independently on worker threads (as zstd frames or gzip members, which can be
+ * simply concatenated), and the writer thread writes them in order to the real output.
+ *
+ * Copyright (c) 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Licensed under GNU GPL v. 3
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <zlib.h>
+#ifndef NOZSTD
+#include <zstd.h>
+#endif
+
+#include "zout.h"
+
+/** Compression context of a worker thread */
+union zctx {
+	z_stream gz;
+#ifndef NOZSTD
+	ZSTD_CCtx *zstd;
+#endif
+};
+
+static bool ctx_init(struct zout *z, union zctx *ctx)
+{
+	memset(ctx, 0, sizeof *ctx);
+
+	switch (z->type) {
+		case ZOUT_GZIP:
+			/* windowBits + 16: gzip wrapper */
+			return deflateInit2(&ctx->gz, z->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+#ifndef NOZSTD
+		case ZOUT_ZSTD:
+			ctx->zstd = ZSTD_createCCtx();
+			return ctx->zstd != NULL;
+#endif
+		default:
+			return false;
+	}
+}
+
+static void ctx_free(struct zout *z, union zctx *ctx)
+{
+	switch (z->type) {
+		case ZOUT_GZIP:
+			deflateEnd(&ctx->gz);
+			break;
+#ifndef NOZSTD
+		case ZOUT_ZSTD:
+			ZSTD_freeCCtx(ctx->zstd);
+			break;
+#endif
+		default:
+			break;
+	}
+}
+
+/** Compress chunk into an independent gzip member or zstd frame */
+static bool chunk_compress(struct zout *z, union zctx *ctx, struct zchunk *c)
+{
+#ifndef NOZSTD
+	size_t rv;
+#endif
+
+	switch (z->type) {
+		case ZOUT_GZIP:
+			deflateReset(&ctx->gz);
+			ctx->gz.next_in = (Bytef *) c->in;
+			ctx->gz.avail_in = c->inlen;
+			ctx->gz.next_out = (Bytef *) c->out;
+			ctx->gz.avail_out = c->outsize;
+			if (deflate(&ctx->gz, Z_FINISH) != Z_STREAM_END)
+				return false;
+			c->outlen = c->outsize - ctx->gz.avail_out;
+			return true;
+#ifndef NOZSTD
+		case ZOUT_ZSTD:
+			rv = ZSTD_compressCCtx(ctx->zstd, c->out, c->outsize, c->in, c->inlen, z->level);
+			if (ZSTD_isError(rv))
+				return false;
+			c->outlen = rv;
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+static void *reader(void *arg)
+{
+	struct zout *z = arg;
+	struct zchunk *c;
+	char buf[BUFSIZ];
+	ssize_t rv;
+	bool eof = false;
+
+	while (!eof) {
+		/* wait for a free chunk */
+		pthread_mutex_lock(&z->lock);
+		while (z->next_in - z->next_out >= z->size && !z->error)
+			pthread_cond_wait(&z->cond, &z->lock);
+
+		if (z->error) {
+			pthread_mutex_unlock(&z->lock);
+
+			/* just drain the pipe, so that writing to stdout never blocks */
+			while ((rv = read(z->rfd, buf, sizeof buf)) > 0 || (rv < 0 && errno == EINTR));
+			break;
+		}
+
+		c = &z->ring[z->next_in % z->size];
+		pthread_mutex_unlock(&z->lock);
+
+		/* fill it */
+		c->inlen = 0;
+		while (c->inlen < ZOUT_CHUNK) {
+			rv = read(z->rfd, c->in + c->inlen, ZOUT_CHUNK - c->inlen);
+			if (rv < 0 && errno == EINTR)
+				continue;
+			if (rv <= 0) {
+				eof = true;
+				break;
+			}
+			c->inlen += rv;
+		}
+
+		/* NB: empty output still needs one (empty) frame */
+		pthread_mutex_lock(&z->lock);
+		if (c->inlen > 0 || (eof && z->next_in == 0)) {
+			c->done = false;
+			z->next_in++;
+		}
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+	}
+
+	pthread_mutex_lock(&z->lock);
+	z->eof = true;
+	pthread_cond_broadcast(&z->cond);
+	pthread_mutex_unlock(&z->lock);
+
+	return NULL;
+}
+
+static void *worker(void *arg)
+{
+	struct zout *z = arg;
+	struct zchunk *c;
+	union zctx ctx;
+	bool ok;
+
+	ok = ctx_init(z, &ctx);
+
+	for (;;) {
+		pthread_mutex_lock(&z->lock);
+		while (z->next_work == z->next_in && !z->eof)
+			pthread_cond_wait(&z->cond, &z->lock);
+
+		if (z->next_work == z->next_in) {
+			pthread_mutex_unlock(&z->lock);
+			break;
+		}
+
+		c = &z->ring[z->next_work++ % z->size];
+		pthread_mutex_unlock(&z->lock);
+
+		if (ok)
+			ok = chunk_compress(z, &ctx, c);
+
+		pthread_mutex_lock(&z->lock);
+		c->done = true;
+		if (!ok) z->error = true;
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+	}
+
+	ctx_free(z, &ctx);
+	return NULL;
+}
+
+static void *writer(void *arg)
+{
+	struct zout *z = arg;
+	struct zchunk *c;
+	size_t len;
+	ssize_t rv;
+	bool error = false;
+
+	for (;;) {
+		pthread_mutex_lock(&z->lock);
+		while (z->next_out == z->next_in ? !z->eof : !z->ring[z->next_out % z->size].done)
+			pthread_cond_wait(&z->cond, &z->lock);
+
+		if (z->next_out == z->next_in) {
+			pthread_mutex_unlock(&z->lock);
+			break;
+		}
+
+		c = &z->ring[z->next_out % z->size];
+		error = z->error;
+		pthread_mutex_unlock(&z->lock);
+
+		for (len = 0; !error && len < c->outlen; len += rv) {
+			rv = write(z->fd, c->out + len, c->outlen - len);
+			if (rv < 0 && errno == EINTR) {
+				rv = 0;
+			} else if (rv <= 0) {
+				dbg(0, "zout: write failed: %m\n");
+				error = true;
+			}
+		}
+
+		pthread_mutex_lock(&z->lock);
+		if (error) z->error = true;
+		z->next_out++;
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+	}
+
+	return NULL;
+}
+
+struct zout *zout_start(mmatic *mm, const char *spec, int threads)
+{
+	struct zout *z;
+	const char *s;
+	size_t outsize;
+	int i, p[2];
+
+	z = mmatic_zalloc(mm, sizeof *z);
+
+	/* method[:level] */
+	if (strncmp(spec, "gzip", 4) == 0) {
+		z->type = ZOUT_GZIP;
+		z->level = 6;
+		outsize = compressBound(ZOUT_CHUNK) + 18; /* + gzip header and trailer */
+#ifndef NOZSTD
+	} else if (strncmp(spec, "zstd", 4) == 0) {
+		z->type = ZOUT_ZSTD;
+		z->level = 3;
+		outsize = ZSTD_compressBound(ZOUT_CHUNK);
+#endif
+	} else {
+		dbg(0, "zout: invalid compression method: %s\n", spec);
+		return NULL;
+	}
+
+	s = spec + 4;
+	if (*s == ':') {
+		z->level = atoi(s + 1);
+	} else if (*s) {
+		dbg(0, "zout: invalid compression method: %s\n", spec);
+		return NULL;
+	}
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	z->threads = MAX(1, MIN(threads, ZOUT_MAXTHREADS));
+
+	/* ring: 2 chunks per thread */
+	z->size = 2 * z->threads;
+	z->ring = mmatic_zalloc(mm, z->size * sizeof(struct zchunk));
+	for (i = 0; i < z->size; i++) {
+		z->ring[i].in = mmatic_alloc(mm, ZOUT_CHUNK);
+		z->ring[i].out = mmatic_alloc(mm, outsize);
+		z->ring[i].outsize = outsize;
+	}
+
+	/* redirect stdout to a pipe */
+	if (pipe2(p, O_CLOEXEC) != 0) {
+		dbg(0, "zout: pipe() failed: %m\n");
+		return NULL;
+	}
+	fcntl(p[1], F_SETPIPE_SZ, 1 << 20);
+
+	fflush(stdout);
+	z->fd = fcntl(1, F_DUPFD_CLOEXEC, 0);
+	if (z->fd < 0 || dup2(p[1], 1) < 0) {
+		dbg(0, "zout: could not redirect standard output: %m\n");
+		return NULL;
+	}
+	close(p[1]);
+	z->rfd = p[0];
+
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->cond, NULL);
+
+	pthread_create(&z->reader, NULL, reader, z);
+	pthread_create(&z->writer, NULL, writer, z);
+	for (i = 0; i < z->threads; i++)
+		pthread_create(&z->workers[i], NULL, worker, z);
+
+	return z;
+}
+
+bool zout_finish(struct zout *z)
+{
+	int i;
+
+	/* restore stdout: closes the pipe, reader gets EOF */
+	fflush(stdout);
+	dup2(z->fd, 1);
+
+	pthread_join(z->reader, NULL);
+	for (i = 0; i < z->threads; i++)
+		pthread_join(z->workers[i], NULL);
+	pthread_join(z->writer, NULL);
+
+	close(z->rfd);
+	close(z->fd);
+
+	if (z->error)
+		dbg(0, "zout: compression failed\n");
+
+	return !z->error;
+}
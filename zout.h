@@ -0,0 +1,67 @@
+/*
+ * zout: multi-threaded compression of standard output
+ *
+ * Copyright (c) 2026 IITiS PAN Gliwice <http://www.iitis.pl/>
+ * Licensed under GNU GPL v. 3
+ */
+
+#ifndef _ZOUT_H_
+#define _ZOUT_H_
+
+#include <pthread.h>
+#include <libpjf/lib.h>
+
+/** Size of input chunk, compressed independently */
+#define ZOUT_CHUNK (4 << 20)
+
+/** Max. number of compression threads */
+#define ZOUT_MAXTHREADS 64
+
+/** A chunk of output */
+struct zchunk {
+	char *in;               /**> input data */
+	size_t inlen;           /**> input length */
+	char *out;              /**> compressed data */
+	size_t outsize;         /**> allocated size of out */
+	size_t outlen;          /**> compressed length */
+	bool done;              /**> compressed? */
+};
+
+struct zout {
+	enum zout_type {
+		ZOUT_GZIP = 1,
+		ZOUT_ZSTD
+	} type;                 /**> compression method */
+	int level;              /**> compression level */
+	int threads;            /**> number of compression threads */
+
+	int fd;                 /**> real output file descriptor */
+	int rfd;                /**> read end of the pipe on stdout */
+
+	struct zchunk *ring;    /**> ring of chunks */
+	int size;               /**> number of chunks in ring */
+	uint64_t next_in;       /**> next chunk to read from the pipe */
+	uint64_t next_work;     /**> next chunk to compress */
+	uint64_t next_out;      /**> next chunk to write */
+	bool eof;               /**> read everything? */
+	bool error;             /**> compression failed? */
+
+	pthread_mutex_t lock;   /**> protects the above */
+	pthread_cond_t cond;    /**> signals any change of the above */
+
+	pthread_t reader;       /**> reads stdout pipe into chunks */
+	pthread_t writer;       /**> writes compressed chunks in order */
+	pthread_t workers[ZOUT_MAXTHREADS]; /**> compress chunks */
+};
+
+/** Start compressing standard output
+ * @param spec      compression method and optional level, eg. "zstd" or "gzip:6"
+ * @param threads   number of compression threads (0 = number of CPUs)
+ * @return          NULL on error */
+struct zout *zout_start(mmatic *mm, const char *spec, int threads);
+
+/** Flush standard output and wait until everything is compressed and written
+ * @retval false    compression or write error */
+bool zout_finish(struct zout *z);
+
+#endif